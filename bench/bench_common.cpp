@@ -0,0 +1,22 @@
+﻿#include "bench_common.hpp"
+#include <time.h>
+
+namespace
+{
+	std::chrono::nanoseconds read_clock(clockid_t clock) noexcept
+	{
+		timespec ts{};
+		clock_gettime(clock, &ts);
+		return std::chrono::seconds{ ts.tv_sec } + std::chrono::nanoseconds{ ts.tv_nsec };
+	}
+}
+
+std::chrono::nanoseconds steam::events::bench::ThreadCpu() noexcept
+{
+	return read_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+std::chrono::nanoseconds steam::events::bench::ProcessCpu() noexcept
+{
+	return read_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
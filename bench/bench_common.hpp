@@ -0,0 +1,78 @@
+﻿#pragma once
+#include "../metrics.hpp"
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace steam::events::bench
+{
+	/// <summary>
+	/// 当前线程和整个进程消耗的CPU时间
+	/// </summary>
+	std::chrono::nanoseconds ThreadCpu() noexcept;
+	std::chrono::nanoseconds ProcessCpu() noexcept;
+
+	inline void Record(latency_histogram& histogram, uint64 ns) noexcept
+	{
+		++histogram.buckets[latency_histogram::BucketOf(ns)];
+		++histogram.count;
+	}
+
+	inline double Seconds(std::chrono::nanoseconds ns) noexcept
+	{
+		return std::chrono::duration<double>(ns).count();
+	}
+
+	inline double Microseconds(uint64 ns) noexcept
+	{
+		return static_cast<double>(ns) / 1000.0;
+	}
+
+	/// <summary>
+	/// 让编译器认为value被读取并可能被修改，防止基准循环被优化掉或去虚拟化
+	/// </summary>
+	template<typename T>
+	inline void Escape(T& value) noexcept
+	{
+		asm volatile("" : "+r"(value) : : "memory");
+	}
+
+	/// <summary>
+	/// arg为"--name=value"时解析value并返回true；格式错误时抛出std::invalid_argument
+	/// </summary>
+	template<typename T>
+	bool ReadOption(std::string_view arg, std::string_view name, T& value)
+	{
+		if (!arg.starts_with("--") || arg.substr(2, name.size()) != name || arg.size() < name.size() + 3 || arg[name.size() + 2] != '=')
+			return false;
+
+		auto text = arg.substr(name.size() + 3);
+		if constexpr (std::is_same_v<T, std::string>)
+		{
+			value = std::string(text);
+		}
+		else if constexpr (std::is_same_v<T, double>)
+		{
+			value = std::stod(std::string(text));
+		}
+		else
+		{
+			auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+			if (ec != std::errc{} || end != text.data() + text.size())
+				throw std::invalid_argument("bad value for --" + std::string(name));
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// 是否为不带值的开关"--name"
+	/// </summary>
+	inline bool ReadFlag(std::string_view arg, std::string_view name) noexcept
+	{
+		return arg.starts_with("--") && arg.substr(2) == name;
+	}
+}
@@ -0,0 +1,161 @@
+﻿// N个线程反复登记和注销处理器时，mthread_dispatcher分发消息风暴的吞吐和延迟
+// contention_bench [--threads=0,1,2,4,8] [--mode=thread|readsafe|pool] [--kind=callback|callresult] [--messages=N] [--ids=8]
+// 登记线程的处理器挂在风暴使用的回调id上，每次登记都会发布新的快照；reg列为登记加注销一对操作的吞吐和耗时（微秒）
+#include "storm.hpp"
+#include <cstdio>
+#include <exception>
+#include <string>
+
+using namespace steam;
+using namespace steam::events;
+using namespace steam::events::bench;
+
+namespace
+{
+	struct contention_args
+	{
+		std::string threads = "0,1,2,4,8";
+		std::string mode = "thread";
+		std::string kind = "callback";
+		storm_options storm;
+	};
+
+	contention_args parse(int argc, char** argv)
+	{
+		contention_args args;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string_view arg = argv[i];
+			if (ReadOption(arg, "threads", args.threads) || ReadOption(arg, "mode", args.mode) || ReadOption(arg, "kind", args.kind)
+				|| ReadOption(arg, "messages", args.storm.messages) || ReadOption(arg, "ids", args.storm.callback_ids))
+				continue;
+			throw std::invalid_argument("unknown option " + std::string(arg));
+		}
+		if (args.mode != "thread" && args.mode != "readsafe" && args.mode != "pool")
+			throw std::invalid_argument("unknown mode " + args.mode);
+		if (args.kind != "callback" && args.kind != "callresult")
+			throw std::invalid_argument("unknown kind " + args.kind);
+		return args;
+	}
+
+	/// <summary>
+	/// 一个登记线程：反复登记并注销处理器，记录每对操作的耗时
+	/// </summary>
+	struct registrar
+	{
+		latency_histogram pairs;
+		uint64 max_pair = 0;
+
+		void Run(mthread_dispatcher& d, const contention_args& args, uint32 index, const std::atomic<bool>& stop)
+		{
+			storm_tally unused{ 0 };
+			int callback_typeid = storm_callback_base + static_cast<int>(index % std::max(args.storm.callback_ids, 1u));
+			storm_probe probe{ callback_typeid, unused, false };
+			// 不会完成的调用结果，句柄与风暴的不重叠
+			SteamAPICall_t handle = (SteamAPICall_t{ 1 } << 40) + (SteamAPICall_t{ index } << 24);
+			bool callresult = args.kind == "callresult";
+
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				auto start = std::chrono::steady_clock::now();
+				if (callresult)
+				{
+					auto ticket = d.CreateCallresult<storm_result>(handle++, [](const storm_result*, bool) {});
+					d.UnRegisterCallResult(ticket);
+				}
+				else
+				{
+					d.RegisterCallback(probe);
+					d.UnRegisterCallback(&probe);
+				}
+				auto ns = static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+				Record(pairs, ns);
+				max_pair = std::max(max_pair, ns);
+			}
+		}
+	};
+
+	std::vector<uint32> parse_list(const std::string& text)
+	{
+		std::vector<uint32> values;
+		std::string_view rest = text;
+		while (!rest.empty())
+		{
+			auto comma = rest.find(',');
+			auto item = rest.substr(0, comma);
+			uint32 value = 0;
+			auto [end, ec] = std::from_chars(item.data(), item.data() + item.size(), value);
+			if (ec != std::errc{} || end != item.data() + item.size())
+				throw std::invalid_argument("bad thread count " + std::string(item));
+			values.push_back(value);
+			if (comma == std::string_view::npos)
+				break;
+			rest.remove_prefix(comma + 1);
+		}
+		return values;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		auto args = parse(argc, argv);
+		auto& opt = args.storm;
+		auto& pipe = StubPipe(steam_pipe::client);
+
+		std::printf("mode=%s kind=%s messages=%llu ids=%u handlers=%u\n", args.mode.c_str(), args.kind.c_str(),
+			static_cast<unsigned long long>(opt.messages), opt.callback_ids, opt.handlers);
+		std::printf("%-8s %12s %9s %9s %10s %12s %10s %10s %10s\n",
+			"writers", "msg/s", "p50(us)", "p99(us)", "max(us)", "reg-pairs/s", "reg-p50", "reg-p99", "reg-max");
+		bool lost = false;
+		for (auto writers : parse_list(args.threads))
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			auto d = mthread_dispatcher::Create(steam_pipe::client);
+			if (args.mode == "pool")
+				d->Start(pool_options{});
+			else
+				d->Start(args.mode == "readsafe");
+
+			std::atomic<bool> stop = false;
+			std::vector<registrar> registrars(writers);
+			std::vector<std::thread> threads;
+			for (uint32 i = 0; i < writers; ++i)
+				threads.emplace_back([&, i] { registrars[i].Run(*d, args, i, stop); });
+
+			auto report = RunStorm(*d, pipe, opt);
+			stop.store(true, std::memory_order_relaxed);
+			for (auto& t : threads)
+				t.join();
+			d->Stop();
+
+			latency_histogram pairs;
+			uint64 max_pair = 0;
+			for (auto& r : registrars)
+			{
+				for (std::size_t b = 0; b < latency_histogram::bucket_count; ++b)
+					pairs.buckets[b] += r.pairs.buckets[b];
+				pairs.count += r.pairs.count;
+				max_pair = std::max(max_pair, r.max_pair);
+			}
+
+			double wall = Seconds(report.elapsed);
+			auto clamp = [](const latency_histogram& h, uint64 max, double q) { return Microseconds(std::min(h.Percentile(q), max)); };
+			std::printf("%-8u %12.0f %9.1f %9.1f %10.1f %12.0f %10.2f %10.2f %10.1f\n",
+				writers,
+				wall > 0 ? static_cast<double>(report.delivered) / wall : 0.0,
+				clamp(report.latency, report.max_latency, 0.5), clamp(report.latency, report.max_latency, 0.99), Microseconds(report.max_latency),
+				wall > 0 ? static_cast<double>(pairs.count) / wall : 0.0,
+				clamp(pairs, max_pair, 0.5), clamp(pairs, max_pair, 0.99), Microseconds(max_pair));
+			std::fflush(stdout);
+			lost = lost || report.delivered != report.messages;
+		}
+		return lost ? 1 : 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::fprintf(stderr, "contention_bench: %s\n", e.what());
+		return 2;
+	}
+}
@@ -0,0 +1,221 @@
+﻿// TypedHandler、LambdaHandler和分发器持有的记录（CreateCallresult）的调用与登记开销
+// handler_bench [--iterations=2000000] [--handlers=8] [--messages=200000]
+// invoke为经HandlerRecord*直接调用Invoke；dispatch为经替身管道和sthread_dispatcher::Pump分发时每个处理器的开销；
+// register为创建记录、登记并注销一个调用结果的开销，allocs为其间的堆分配次数
+#include "storm.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <optional>
+#include <string>
+
+using namespace steam;
+using namespace steam::events;
+using namespace steam::events::bench;
+
+namespace
+{
+	std::atomic<uint64> allocations = 0;
+}
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	struct bench_callback : storm_param
+	{
+		static constexpr int k_iCallback = storm_callback_base;
+	};
+
+	/// <summary>
+	/// 处理器捕获的状态与常见的用法相当：一个指针加两个值，超过std::function的小对象缓冲区
+	/// </summary>
+	struct sink
+	{
+		uint64* total;
+		uint64 a;
+		uint64 b;
+
+		void HandleResult(bool, const storm_result* param) { *total += param->seq + a; }
+		void HandleCallback(const bench_callback* param) { *total += param->seq + b; }
+	};
+
+	struct handler_args
+	{
+		uint64 iterations = 2000000u;
+		uint32 handlers = 8u;
+		uint64 messages = 200000u;
+	};
+
+	handler_args parse(int argc, char** argv)
+	{
+		handler_args args;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string_view arg = argv[i];
+			if (ReadOption(arg, "iterations", args.iterations) || ReadOption(arg, "handlers", args.handlers) || ReadOption(arg, "messages", args.messages))
+				continue;
+			throw std::invalid_argument("unknown option " + std::string(arg));
+		}
+		if (!args.iterations || !args.handlers || !args.messages)
+			throw std::invalid_argument("counts must not be zero");
+		return args;
+	}
+
+	double per_op(std::chrono::steady_clock::duration elapsed, uint64 ops)
+	{
+		return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / static_cast<double>(ops);
+	}
+
+	// 经基类指针调用，编译器看不到具体类型
+	double measure_invoke(HandlerRecord& record, uint64 iterations)
+	{
+		storm_result param{};
+		HandlerRecord* base = &record;
+		auto start = std::chrono::steady_clock::now();
+		for (uint64 i = 0; i < iterations; ++i)
+		{
+			Escape(base);
+			param.seq = i;
+			base->Invoke(&param, false);
+		}
+		return per_op(std::chrono::steady_clock::now() - start, iterations);
+	}
+
+	// make(i)返回第i个回调记录
+	template<typename Make>
+	double measure_dispatch(const handler_args& args, Make&& make)
+	{
+		auto& pipe = StubPipe(steam_pipe::client);
+		pipe.Reset(4096u, sizeof(bench_callback));
+		sthread_dispatcher d{ steam_pipe::client };
+
+		std::vector<std::unique_ptr<HandlerRecord>> records;
+		for (uint32 i = 0; i < args.handlers; ++i)
+		{
+			records.push_back(make(i));
+			d.RegisterCallback(*records.back());
+		}
+
+		bench_callback param{};
+		auto start = std::chrono::steady_clock::now();
+		for (uint64 i = 0; i < args.messages; ++i)
+		{
+			param.seq = i;
+			while (!pipe.PushCallback(1, bench_callback::k_iCallback, &param, sizeof(param)))
+				d.Pump();
+		}
+		while (pipe.Backlog())
+			d.Pump();
+		auto elapsed = std::chrono::steady_clock::now() - start;
+
+		for (auto& record : records)
+			d.UnRegisterCallback(record.get());
+		return per_op(elapsed, args.messages * args.handlers);
+	}
+
+	struct register_cost
+	{
+		double ns;
+		double allocs;
+	};
+
+	// once(d, handle)创建、登记并注销一个调用结果
+	template<typename Once>
+	register_cost measure_register(uint64 iterations, Once&& once)
+	{
+		sthread_dispatcher d{ steam_pipe::client };
+		// 先让表和slab长到稳定的大小
+		for (SteamAPICall_t h = 1; h <= 1024; ++h)
+			once(d, h);
+
+		auto allocs = allocations.load(std::memory_order_relaxed);
+		auto start = std::chrono::steady_clock::now();
+		for (uint64 i = 0; i < iterations; ++i)
+			once(d, static_cast<SteamAPICall_t>(i + 1));
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		return { per_op(elapsed, iterations), static_cast<double>(allocations.load(std::memory_order_relaxed) - allocs) / static_cast<double>(iterations) };
+	}
+
+	void print(const char* kind, double invoke, double dispatch, register_cost reg)
+	{
+		std::printf("%-8s %12.2f %14.2f %14.2f %8.2f\n", kind, invoke, dispatch, reg.ns, reg.allocs);
+		std::fflush(stdout);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		auto args = parse(argc, argv);
+		uint64 total = 0;
+		sink s{ &total, 1u, 2u };
+
+		std::printf("iterations=%llu handlers=%u messages=%llu\n", static_cast<unsigned long long>(args.iterations), args.handlers,
+			static_cast<unsigned long long>(args.messages));
+		std::printf("%-8s %12s %14s %14s %8s\n", "kind", "invoke(ns)", "dispatch(ns)", "register(ns)", "allocs");
+
+		{
+			using record_t = TypedHandler<storm_result, sink>;
+			record_t record{ 1, sink{ s } };
+			auto invoke = measure_invoke(record, args.iterations);
+			auto dispatch = measure_dispatch(args, [&](uint32) { return std::make_unique<TypedHandler<bench_callback, sink>>(sink{ s }); });
+			auto reg = measure_register(args.iterations, [&](sthread_dispatcher& d, SteamAPICall_t h)
+				{
+					record_t r{ h, sink{ s } };
+					d.RegisterCallresult(r);
+					d.UnRegisterCallResult(&r);
+				});
+			print("typed", invoke, dispatch, reg);
+		}
+		{
+			auto fn = [s](const storm_result* param, bool) { *s.total += param->seq + s.a; };
+			auto cbfn = [s](const bench_callback* param, bool) { *s.total += param->seq + s.b; };
+			LambdaHandler<storm_result> record{ 1, fn };
+			auto invoke = measure_invoke(record, args.iterations);
+			auto dispatch = measure_dispatch(args, [&](uint32) { return std::make_unique<LambdaHandler<bench_callback>>(k_uAPICallInvalid, cbfn); });
+			auto reg = measure_register(args.iterations, [&](sthread_dispatcher& d, SteamAPICall_t h)
+				{
+					LambdaHandler<storm_result> r{ h, fn };
+					d.RegisterCallresult(r);
+					d.UnRegisterCallResult(&r);
+				});
+			print("lambda", invoke, dispatch, reg);
+		}
+		{
+			// 分发器持有的记录只用于调用结果，没有单独的调用和分发开销
+			auto fn = [s](const storm_result* param, bool) { if (param) *s.total += param->seq + s.a; };
+			auto reg = measure_register(args.iterations, [&](sthread_dispatcher& d, SteamAPICall_t h)
+				{
+					d.UnRegisterCallResult(d.CreateCallresult<storm_result>(h, fn));
+				});
+			std::printf("%-8s %12s %14s %14.2f %8.2f\n", "pooled", "-", "-", reg.ns, reg.allocs);
+		}
+
+		Escape(total);
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::fprintf(stderr, "handler_bench: %s\n", e.what());
+		return 2;
+	}
+}
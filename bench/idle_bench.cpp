@@ -0,0 +1,115 @@
+﻿// 比较mthread_dispatcher各空闲策略的空闲CPU占用与唤醒延迟
+// idle_bench [--idle-ms=1000] [--wakes=200] [--rate=200] [--readsafe]
+// idle-cpu为没有消息时分发线程占用的核数；唤醒延迟以--rate条每秒的稀疏回调测量，每条到来时分发线程多半已退避到睡眠
+#include "storm.hpp"
+#include <cstdio>
+#include <exception>
+#include <string>
+
+using namespace steam;
+using namespace steam::events;
+using namespace steam::events::bench;
+
+namespace
+{
+	struct idle_preset
+	{
+		const char* name;
+		idle_options idle;
+	};
+
+	using std::chrono::microseconds;
+
+	const idle_preset presets[] = {
+		{ "yield", { 64u, 64u, microseconds{ 50 }, microseconds{ 0 } } },
+		{ "sleep100us", { 64u, 64u, microseconds{ 50 }, microseconds{ 100 } } },
+		{ "sleep500us", { 64u, 64u, microseconds{ 50 }, microseconds{ 500 } } },
+		{ "default", {} },
+		{ "sleep10ms", { 64u, 64u, microseconds{ 50 }, microseconds{ 10000 } } },
+	};
+
+	struct idle_args
+	{
+		uint32 idle_ms = 1000u;
+		uint32 wakes = 200u;
+		uint32 rate = 200u;
+		bool readsafe = false;
+	};
+
+	idle_args parse(int argc, char** argv)
+	{
+		idle_args args;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string_view arg = argv[i];
+			if (ReadOption(arg, "idle-ms", args.idle_ms) || ReadOption(arg, "wakes", args.wakes) || ReadOption(arg, "rate", args.rate))
+				continue;
+			if (ReadFlag(arg, "readsafe"))
+			{
+				args.readsafe = true;
+				continue;
+			}
+			throw std::invalid_argument("unknown option " + std::string(arg));
+		}
+		if (!args.rate)
+			throw std::invalid_argument("--rate must not be zero");
+		return args;
+	}
+
+	// 没有消息时分发线程占用的核数
+	double measure_idle(uint32 idle_ms)
+	{
+		// 先等循环退避下来
+		std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+		auto cpu0 = ProcessCpu();
+		auto start = std::chrono::steady_clock::now();
+		std::this_thread::sleep_for(std::chrono::milliseconds{ idle_ms });
+		auto cpu = ProcessCpu() - cpu0;
+		return Seconds(cpu) / Seconds(std::chrono::steady_clock::now() - start);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		auto args = parse(argc, argv);
+		auto& pipe = StubPipe(steam_pipe::client);
+
+		storm_options opt;
+		opt.messages = args.wakes;
+		opt.rate = args.rate;
+		opt.callresult_ratio = 0.0;
+		opt.callback_ids = 1u;
+		opt.handlers = 1u;
+		opt.outstanding = 0u;
+		opt.payload_min = opt.payload_max = sizeof(storm_result);
+
+		std::printf("idle=%ums wakes=%u rate=%u/s %s\n", args.idle_ms, args.wakes, args.rate, args.readsafe ? "readsafe" : "thread");
+		std::printf("%-11s %8s %8s %8s %10s %10s %10s %9s\n", "preset", "spin", "yield", "max(us)", "idle-cpu", "p50(us)", "p99(us)", "max(us)");
+		bool lost = false;
+		for (auto& preset : presets)
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			auto d = mthread_dispatcher::Create(steam_pipe::client);
+			d->Idle() = preset.idle;
+			d->Start(args.readsafe);
+			double idle = measure_idle(args.idle_ms);
+			auto report = RunStorm(*d, pipe, opt);
+			d->Stop();
+
+			auto percentile = [&](double q) { return Microseconds(std::min(report.latency.Percentile(q), report.max_latency)); };
+			std::printf("%-11s %8u %8u %8lld %10.3f %10.1f %10.1f %9.1f\n",
+				preset.name, preset.idle.spin, preset.idle.yield, static_cast<long long>(preset.idle.max_sleep.count()),
+				idle, percentile(0.5), percentile(0.99), Microseconds(report.max_latency));
+			std::fflush(stdout);
+			lost = lost || report.delivered != report.messages;
+		}
+		return lost ? 1 : 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::fprintf(stderr, "idle_bench: %s\n", e.what());
+		return 2;
+	}
+}
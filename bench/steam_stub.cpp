@@ -0,0 +1,186 @@
+﻿#include "steam_stub.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+	steam::events::bench::stub_pipe pipes[2];
+
+	steam::events::bench::stub_pipe* pipe_of(steam::events::dll::HSteamPipe handle) noexcept
+	{
+		if (handle < 1 || handle > 2)
+			return nullptr;
+		return &pipes[handle - 1];
+	}
+}
+
+steam::events::bench::stub_pipe& steam::events::bench::StubPipe(steam_pipe pipe) noexcept
+{
+	return pipes[pipe == steam_pipe::client ? 0 : 1];
+}
+
+void steam::events::bench::stub_pipe::Reset(std::size_t depth, uint32 payload)
+{
+	if (!depth)
+		throw std::invalid_argument("depth must not be zero");
+
+	depth = std::bit_ceil(depth);
+	max_payload = payload;
+	stride = (sizeof(slot) + payload + sizeof(uint64) - 1) / sizeof(uint64);
+	storage.assign(depth * stride, 0);
+	mask = depth - 1;
+	head.store(0, std::memory_order_relaxed);
+	tail.store(0, std::memory_order_relaxed);
+	current = nullptr;
+	frames.store(0, std::memory_order_relaxed);
+}
+
+steam::events::bench::stub_pipe::slot* steam::events::bench::stub_pipe::at(std::size_t index) noexcept
+{
+	return reinterpret_cast<slot*>(storage.data() + (index & mask) * stride);
+}
+
+steam::uint8* steam::events::bench::stub_pipe::payload(slot* s) noexcept
+{
+	return reinterpret_cast<uint8*>(s + 1);
+}
+
+steam::events::bench::stub_pipe::slot* steam::events::bench::stub_pipe::reserve(uint32 size)
+{
+	if (size > max_payload)
+		throw std::length_error("payload exceeds the stub pipe slot");
+
+	auto h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) > mask)
+		return nullptr;
+	return at(h);
+}
+
+bool steam::events::bench::stub_pipe::PushCallback(int32 user, int callback_typeid, const void* param, uint32 size)
+{
+	auto* s = reserve(size);
+	if (!s)
+		return false;
+
+	s->user = user;
+	s->callback_typeid = callback_typeid;
+	s->size = size;
+	s->iofail = false;
+	std::memcpy(payload(s), param, size);
+	head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	return true;
+}
+
+bool steam::events::bench::stub_pipe::PushCallresult(int32 user, SteamAPICall_t handle, int callback_typeid, const void* param, uint32 size, bool iofail)
+{
+	auto* s = reserve(size);
+	if (!s)
+		return false;
+
+	s->user = user;
+	s->callback_typeid = dll::SteamAPICallCompleted_t::callback_typeid;
+	s->size = size;
+	s->iofail = iofail;
+	s->apicall = { handle, callback_typeid, size };
+	std::memcpy(payload(s), param, size);
+	head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	return true;
+}
+
+bool steam::events::bench::stub_pipe::Next(dll::CallbackMsg_t& msg) noexcept
+{
+	auto t = tail.load(std::memory_order_relaxed);
+	if (t == head.load(std::memory_order_acquire))
+		return false;
+
+	current = at(t);
+	msg.m_hSteamUser = current->user;
+	msg.m_iCallback = current->callback_typeid;
+	if (current->callback_typeid == dll::SteamAPICallCompleted_t::callback_typeid)
+	{
+		msg.m_pubParam = reinterpret_cast<uint8*>(&current->apicall);
+		msg.m_cubParam = sizeof(current->apicall);
+	}
+	else
+	{
+		msg.m_pubParam = payload(current);
+		msg.m_cubParam = static_cast<int>(current->size);
+	}
+	return true;
+}
+
+void steam::events::bench::stub_pipe::FreeLast() noexcept
+{
+	if (!current)
+		return;
+
+	current = nullptr;
+	tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool steam::events::bench::stub_pipe::Callresult(SteamAPICall_t handle, void* dest, int size, int callback_typeid, bool& iofail) noexcept
+{
+	// 与steam一样，只能在处理SteamAPICallCompleted_t时取出它携带的结果
+	if (!current || current->callback_typeid != dll::SteamAPICallCompleted_t::callback_typeid
+		|| current->apicall.m_hAsyncCall != handle || current->apicall.m_iCallback != callback_typeid)
+		return false;
+
+	std::memcpy(dest, payload(current), std::min<std::size_t>(static_cast<std::size_t>(size), current->size));
+	iofail = current->iofail;
+	return true;
+}
+
+std::size_t steam::events::bench::stub_pipe::Backlog() const noexcept
+{
+	return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+steam::events::dll::HSteamPipe STEAM_CALLTYPE steam::events::dll::SteamAPI_GetHSteamPipe()
+{
+	return 1;
+}
+
+steam::events::dll::HSteamUser STEAM_CALLTYPE steam::events::dll::SteamAPI_GetHSteamUser()
+{
+	return 1;
+}
+
+steam::events::dll::HSteamPipe STEAM_CALLTYPE steam::events::dll::SteamGameServer_GetHSteamPipe()
+{
+	return 2;
+}
+
+steam::events::dll::HSteamUser STEAM_CALLTYPE steam::events::dll::SteamGameServer_GetHSteamUser()
+{
+	return 2;
+}
+
+void STEAM_CALLTYPE steam::events::dll::SteamAPI_ManualDispatch_Init()
+{
+}
+
+void STEAM_CALLTYPE steam::events::dll::SteamAPI_ManualDispatch_RunFrame(HSteamPipe hSteamPipe)
+{
+	if (auto* pipe = pipe_of(hSteamPipe))
+		pipe->RunFrame();
+}
+
+bool STEAM_CALLTYPE steam::events::dll::SteamAPI_ManualDispatch_GetNextCallback(HSteamPipe hSteamPipe, CallbackMsg_t* pCallbackMsg)
+{
+	auto* pipe = pipe_of(hSteamPipe);
+	return pipe && pipe->Next(*pCallbackMsg);
+}
+
+void STEAM_CALLTYPE steam::events::dll::SteamAPI_ManualDispatch_FreeLastCallback(HSteamPipe hSteamPipe)
+{
+	if (auto* pipe = pipe_of(hSteamPipe))
+		pipe->FreeLast();
+}
+
+bool STEAM_CALLTYPE steam::events::dll::SteamAPI_ManualDispatch_GetAPICallResult(HSteamPipe hSteamPipe, SteamAPICall_t hSteamAPICall, void* pCallback, int cubCallback, int iCallbackExpected, bool& pbFailed)
+{
+	auto* pipe = pipe_of(hSteamPipe);
+	return pipe && pipe->Callresult(hSteamAPICall, pCallback, cubCallback, iCallbackExpected, pbFailed);
+}
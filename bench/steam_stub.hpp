@@ -0,0 +1,79 @@
+﻿#pragma once
+#include "../steam_imports.hpp"
+#include "../events.hpp"
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace steam::events::bench
+{
+	/// <summary>
+	/// steam_imports.hpp中导出函数的替身，每个steam_pipe一个实例：单生产者单消费者的环形消息队列
+	/// <para>生产者是基准测试的发生器线程，消费者是分发器读取管道的线程；调用结果的参数跟在SteamAPICallCompleted_t之后，
+	/// GetAPICallResult从当前取出的那条消息中复制</para>
+	/// </summary>
+	class stub_pipe
+	{
+	private:
+		struct slot
+		{
+			int32 user;
+			int callback_typeid;
+			// 回调参数或调用结果参数的字节数
+			uint32 size;
+			bool iofail;
+			dll::SteamAPICallCompleted_t apicall;
+		};
+
+		// 以uint64为单位，消息参数按8字节对齐
+		std::vector<uint64> storage;
+		std::size_t stride = 0;
+		std::size_t mask = 0;
+		uint32 max_payload = 0;
+
+		alignas(64) std::atomic<std::size_t> head = 0;
+		alignas(64) std::atomic<std::size_t> tail = 0;
+		// 消费者取出后尚未FreeLastCallback的消息
+		slot* current = nullptr;
+		std::atomic<uint64> frames = 0;
+
+		slot* at(std::size_t index) noexcept;
+		uint8* payload(slot* s) noexcept;
+		// 队列已满时返回nullptr
+		slot* reserve(uint32 size);
+	public:
+		/// <summary>
+		/// 清空队列，最多积压depth条（向上取整到2的幂）、每条参数不超过payload字节；只能在没有线程读写时调用
+		/// </summary>
+		void Reset(std::size_t depth, uint32 payload);
+
+		/// <summary>
+		/// 放入一条回调，队列已满时返回false
+		/// </summary>
+		bool PushCallback(int32 user, int callback_typeid, const void* param, uint32 size);
+		/// <summary>
+		/// 放入handle完成的通知，结果参数随通知一起保存，队列已满时返回false
+		/// </summary>
+		bool PushCallresult(int32 user, SteamAPICall_t handle, int callback_typeid, const void* param, uint32 size, bool iofail = false);
+
+		// 以下由导出函数的替身调用
+		bool Next(dll::CallbackMsg_t& msg) noexcept;
+		void FreeLast() noexcept;
+		bool Callresult(SteamAPICall_t handle, void* dest, int size, int callback_typeid, bool& iofail) noexcept;
+		void RunFrame() noexcept { frames.fetch_add(1, std::memory_order_relaxed); }
+
+		/// <summary>
+		/// 尚未取出的消息数，任何线程都可以调用
+		/// </summary>
+		std::size_t Backlog() const noexcept;
+		/// <summary>
+		/// 分发器调用SteamAPI_ManualDispatch_RunFrame的次数
+		/// </summary>
+		uint64 Frames() const noexcept { return frames.load(std::memory_order_relaxed); }
+	};
+
+	/// <summary>
+	/// 替身管道句柄：客户端为1，游戏服务器为2
+	/// </summary>
+	stub_pipe& StubPipe(steam_pipe pipe) noexcept;
+}
@@ -0,0 +1,84 @@
+﻿#include "storm.hpp"
+#include <algorithm>
+#include <cstring>
+
+steam::int64 steam::events::bench::StormClock() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void steam::events::bench::storm_tally::Deliver(const storm_param* param, bool primary) noexcept
+{
+	invocations.fetch_add(1, std::memory_order_relaxed);
+	if (!primary || param->seq >= latency.size())
+		return;
+
+	// 0表示未送达
+	latency[param->seq] = static_cast<uint64>(std::max<int64>(StormClock() - param->stamp, 1));
+	delivered.fetch_add(1, std::memory_order_release);
+}
+
+void steam::events::bench::storm_tally::Fill(storm_report& report) const
+{
+	report.delivered = delivered.load(std::memory_order_acquire);
+	report.invocations = invocations.load(std::memory_order_relaxed);
+	for (auto ns : latency)
+	{
+		if (!ns)
+			continue;
+		Record(report.latency, ns);
+		report.max_latency = std::max(report.max_latency, ns);
+	}
+}
+
+steam::events::bench::storm_generator::storm_generator(const storm_options& opt) :
+	opt(opt),
+	rng(opt.seed),
+	callresult(std::clamp(opt.callresult_ratio, 0.0, 1.0)),
+	size(std::max<uint32>(opt.payload_min, sizeof(storm_result)), std::max<uint32>(opt.payload_max, sizeof(storm_result))),
+	id(0u, std::max(opt.callback_ids, 1u) - 1u),
+	buffer((std::max<uint32>(opt.payload_max, sizeof(storm_result)) + sizeof(uint64) - 1) / sizeof(uint64), 0)
+{
+	if (opt.payload_min > opt.payload_max)
+		throw std::invalid_argument("payload_min exceeds payload_max");
+}
+
+steam::events::bench::storm_generator::message steam::events::bench::storm_generator::Plan(uint64 seq) noexcept
+{
+	message m{};
+	// 没有回调处理器时只发调用结果
+	m.callresult = !opt.callback_ids || callresult(rng);
+	m.callback_typeid = m.callresult ? storm_result::k_iCallback : storm_callback_base + static_cast<int>(id(rng));
+	m.size = size(rng);
+	reinterpret_cast<storm_param*>(buffer.data())->seq = seq;
+	return m;
+}
+
+void steam::events::bench::storm_generator::Stamp() noexcept
+{
+	reinterpret_cast<storm_param*>(buffer.data())->stamp = StormClock();
+}
+
+void steam::events::bench::PrintStormHeader(std::FILE* out)
+{
+	std::fprintf(out, "%-10s %10s %12s %9s %9s %9s %10s %9s %9s %8s\n",
+		"mode", "messages", "msg/s", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "disp-cpu", "gen-cpu", "lost");
+}
+
+void steam::events::bench::PrintStormReport(std::FILE* out, const char* mode, const storm_report& report)
+{
+	double wall = Seconds(report.elapsed);
+	// 分位取桶的上界，不超过实际的最大值
+	auto percentile = [&](double q) { return Microseconds(std::min(report.latency.Percentile(q), report.max_latency)); };
+	std::fprintf(out, "%-10s %10llu %12.0f %9.1f %9.1f %9.1f %10.1f %9.2f %9.2f %8llu\n",
+		mode,
+		static_cast<unsigned long long>(report.messages),
+		wall > 0 ? static_cast<double>(report.delivered) / wall : 0.0,
+		percentile(0.5),
+		percentile(0.99),
+		percentile(0.999),
+		Microseconds(report.max_latency),
+		wall > 0 ? Seconds(report.dispatch_cpu) / wall : 0.0,
+		wall > 0 ? Seconds(report.producer_cpu) / wall : 0.0,
+		static_cast<unsigned long long>(report.messages - report.delivered));
+}
@@ -0,0 +1,271 @@
+﻿#pragma once
+#include "bench_common.hpp"
+#include "steam_stub.hpp"
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace steam::events::bench
+{
+	/// <summary>
+	/// 发生器写在每条消息参数开头的标记，处理器据此计算从放入管道到开始处理的延迟
+	/// </summary>
+	struct storm_param
+	{
+		uint64 seq;
+		int64 stamp;
+	};
+
+	struct storm_result : storm_param
+	{
+		static constexpr int k_iCallback = 1101;
+	};
+
+	// 回调使用storm_callback_base起的callback_ids个id
+	constexpr int storm_callback_base = 1201;
+
+	/// <summary>
+	/// 消息风暴的形状
+	/// </summary>
+	struct storm_options
+	{
+		uint64 messages = 200000u;
+		// 调用结果占全部消息的比例
+		double callresult_ratio = 0.25;
+		// 参数字节数在[payload_min, payload_max]内均匀分布，不小于sizeof(storm_param)
+		uint32 payload_min = 16u;
+		uint32 payload_max = 256u;
+		// 回调的种类数和每种回调的处理器数
+		uint32 callback_ids = 8u;
+		uint32 handlers = 2u;
+		// 同时登记着、尚未完成的调用结果数
+		uint32 outstanding = 256u;
+		// 每秒放入的消息数，0表示尽快放入
+		uint32 rate = 0u;
+		// 替身管道最多积压的消息数
+		uint32 depth = 4096u;
+		// mthread_dispatcher经PostCallresult登记调用结果，不加锁
+		bool post = false;
+		uint32 seed = 1u;
+	};
+
+	struct storm_report
+	{
+		uint64 messages = 0;
+		// 送达的消息数，每条消息只计第一个处理器
+		uint64 delivered = 0;
+		// 处理器被调用的次数
+		uint64 invocations = 0;
+		// 从放入第一条消息到最后一条送达
+		std::chrono::nanoseconds elapsed{};
+		// 分发一侧（分发线程、工作线程或Pump）和发生器消耗的CPU时间
+		std::chrono::nanoseconds dispatch_cpu{};
+		std::chrono::nanoseconds producer_cpu{};
+		latency_histogram latency;
+		uint64 max_latency = 0;
+	};
+
+	/// <summary>
+	/// 风暴的送达记录，处理器可以在任何线程调用
+	/// </summary>
+	class storm_tally
+	{
+	private:
+		std::vector<uint64> latency;
+		std::atomic<uint64> delivered = 0;
+		std::atomic<uint64> invocations = 0;
+	public:
+		explicit storm_tally(uint64 messages) : latency(messages, 0) {}
+
+		void Deliver(const storm_param* param, bool primary) noexcept;
+		uint64 Delivered() const noexcept { return delivered.load(std::memory_order_acquire); }
+		// 只能在所有消息送达或分发停止后调用
+		void Fill(storm_report& report) const;
+	};
+
+	/// <summary>
+	/// 回调处理器，每种回调的第一个处理器负责计算延迟
+	/// </summary>
+	class storm_probe final : public HandlerRecord
+	{
+	private:
+		storm_tally& tally;
+		const bool primary;
+	public:
+		storm_probe(int callback_typeid, storm_tally& tally, bool primary) : HandlerRecord(callback_typeid, k_uAPICallInvalid), tally(tally), primary(primary) {}
+
+		virtual void Invoke(const void* param, bool) override
+		{
+			tally.Deliver(static_cast<const storm_param*>(param), primary);
+		}
+	};
+
+	/// <summary>
+	/// 决定每条消息的种类和大小，并把标记写入参数
+	/// </summary>
+	class storm_generator
+	{
+	private:
+		const storm_options opt;
+		std::mt19937_64 rng;
+		std::bernoulli_distribution callresult;
+		std::uniform_int_distribution<uint32> size;
+		std::uniform_int_distribution<uint32> id;
+		std::vector<uint64> buffer;
+	public:
+		struct message
+		{
+			bool callresult;
+			int callback_typeid;
+			uint32 size;
+		};
+
+		explicit storm_generator(const storm_options& opt);
+
+		message Plan(uint64 seq) noexcept;
+		// 放入管道前调用，写入当前时间
+		void Stamp() noexcept;
+		const void* Payload() const noexcept { return buffer.data(); }
+	};
+
+	/// <summary>
+	/// 不在发生器线程上分发，用于mthread_dispatcher
+	/// </summary>
+	struct no_pump
+	{
+		void operator()() const noexcept {}
+	};
+
+	int64 StormClock() noexcept;
+
+	/// <summary>
+	/// 登记处理器，在当前线程放入opt.messages条消息并等待全部送达
+	/// <para>pump为no_pump时分发器应已在其他线程运行；否则发生器在管道满时和每放入一批消息后调用pump，在本线程分发</para>
+	/// <para>返回前注销所有处理器，未触发的调用结果一并注销</para>
+	/// </summary>
+	template<typename Dispatcher, typename Pump = no_pump>
+	storm_report RunStorm(Dispatcher& d, stub_pipe& pipe, const storm_options& opt, Pump pump = {})
+	{
+		constexpr bool inline_pump = !std::is_same_v<Pump, no_pump>;
+		constexpr uint64 pump_batch = 64u;
+
+		storm_tally tally{ opt.messages };
+		storm_generator gen{ opt };
+
+		std::vector<std::unique_ptr<storm_probe>> probes;
+		for (uint32 i = 0; i < opt.callback_ids; ++i)
+		{
+			for (uint32 k = 0; k < opt.handlers; ++k)
+			{
+				probes.push_back(std::make_unique<storm_probe>(storm_callback_base + static_cast<int>(i), tally, k == 0));
+				d.RegisterCallback(*probes.back());
+			}
+		}
+
+		SteamAPICall_t nexthandle = 1;
+		std::deque<callresult_ticket> pending;
+		auto expect = [&]
+			{
+				auto handler = [&tally](const storm_result* param, bool)
+					{
+						if (param)
+							tally.Deliver(param, true);
+					};
+				if constexpr (requires { d.template PostCallresult<storm_result>(nexthandle, handler); })
+				{
+					if (opt.post)
+					{
+						pending.push_back(d.template PostCallresult<storm_result>(nexthandle++, handler));
+						return;
+					}
+				}
+				pending.push_back(d.template CreateCallresult<storm_result>(nexthandle++, handler));
+			};
+		for (uint32 i = 0; i < std::max(opt.outstanding, 1u); ++i)
+			expect();
+
+		std::chrono::nanoseconds pumpcpu{};
+		auto run_pump = [&]
+			{
+				if constexpr (inline_pump)
+				{
+					auto before = ThreadCpu();
+					pump();
+					pumpcpu += ThreadCpu() - before;
+				}
+				else
+				{
+					std::this_thread::yield();
+				}
+			};
+
+		auto cpu0 = ThreadCpu();
+		auto proc0 = ProcessCpu();
+		auto start = std::chrono::steady_clock::now();
+		for (uint64 seq = 0; seq < opt.messages; ++seq)
+		{
+			if (opt.rate)
+			{
+				auto due = start + std::chrono::nanoseconds{ static_cast<int64>(seq * 1'000'000'000ull / opt.rate) };
+				if constexpr (inline_pump)
+				{
+					while (std::chrono::steady_clock::now() < due)
+						run_pump();
+				}
+				else
+				{
+					// 睡眠而不是自旋，不与分发线程争抢CPU；标记在醒来后写入，睡过头不计入延迟
+					std::this_thread::sleep_until(due);
+				}
+			}
+
+			auto m = gen.Plan(seq);
+			for (;;)
+			{
+				gen.Stamp();
+				bool pushed = m.callresult
+					? pipe.PushCallresult(1, pending.front().handle, storm_result::k_iCallback, gen.Payload(), m.size)
+					: pipe.PushCallback(1, m.callback_typeid, gen.Payload(), m.size);
+				if (pushed)
+					break;
+				run_pump();
+			}
+			if (m.callresult)
+			{
+				pending.pop_front();
+				expect();
+			}
+
+			if constexpr (inline_pump)
+			{
+				if ((seq + 1) % pump_batch == 0)
+					run_pump();
+			}
+		}
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ 30 };
+		while (tally.Delivered() < opt.messages && std::chrono::steady_clock::now() < deadline)
+			run_pump();
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		auto producer = ThreadCpu() - cpu0 - pumpcpu;
+		auto process = ProcessCpu() - proc0;
+
+		for (auto& ticket : pending)
+			d.UnRegisterCallResult(ticket);
+		for (auto& probe : probes)
+			d.UnRegisterCallback(probe.get());
+
+		storm_report report;
+		report.messages = opt.messages;
+		report.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+		report.producer_cpu = producer;
+		report.dispatch_cpu = inline_pump ? pumpcpu : process - producer;
+		tally.Fill(report);
+		return report;
+	}
+
+	void PrintStormHeader(std::FILE* out);
+	void PrintStormReport(std::FILE* out, const char* mode, const storm_report& report);
+}
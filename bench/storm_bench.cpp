@@ -0,0 +1,125 @@
+﻿// 用替身steam_api制造消息风暴，比较各分发模式的吞吐、延迟和CPU占用
+// storm_bench [--modes=sthread,thread,readsafe,pool,pipeline] [--messages=N] [--ratio=0.25] [--payload-min=16] [--payload-max=256]
+//             [--ids=8] [--handlers=2] [--outstanding=256] [--rate=0] [--depth=4096] [--workers=0] [--post] [--seed=1]
+// disp-cpu和gen-cpu为分发一侧与发生器占用的核数；有消息未送达时返回1
+#include "storm.hpp"
+#include <cstdio>
+#include <exception>
+#include <string>
+
+using namespace steam::events;
+using namespace steam::events::bench;
+
+namespace
+{
+	struct storm_args
+	{
+		storm_options storm;
+		std::string modes = "sthread,thread,readsafe,pool,pipeline";
+		unsigned workers = 0;
+	};
+
+	storm_args parse(int argc, char** argv)
+	{
+		storm_args args;
+		auto& s = args.storm;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string_view arg = argv[i];
+			if (ReadOption(arg, "modes", args.modes) || ReadOption(arg, "messages", s.messages) || ReadOption(arg, "ratio", s.callresult_ratio)
+				|| ReadOption(arg, "payload-min", s.payload_min) || ReadOption(arg, "payload-max", s.payload_max)
+				|| ReadOption(arg, "ids", s.callback_ids) || ReadOption(arg, "handlers", s.handlers) || ReadOption(arg, "outstanding", s.outstanding)
+				|| ReadOption(arg, "rate", s.rate) || ReadOption(arg, "depth", s.depth) || ReadOption(arg, "workers", args.workers)
+				|| ReadOption(arg, "seed", s.seed))
+				continue;
+			if (ReadFlag(arg, "post"))
+			{
+				s.post = true;
+				continue;
+			}
+			throw std::invalid_argument("unknown option " + std::string(arg));
+		}
+		return args;
+	}
+
+	bool has_mode(const std::string& modes, std::string_view mode)
+	{
+		std::string_view rest = modes;
+		while (!rest.empty())
+		{
+			auto comma = rest.find(',');
+			if (rest.substr(0, comma) == mode)
+				return true;
+			if (comma == std::string_view::npos)
+				break;
+			rest.remove_prefix(comma + 1);
+		}
+		return false;
+	}
+
+	template<typename Start>
+	storm_report run_mthread(const storm_options& opt, Start&& start)
+	{
+		auto& pipe = StubPipe(steam_pipe::client);
+		auto d = mthread_dispatcher::Create(steam_pipe::client);
+		start(*d);
+		auto report = RunStorm(*d, pipe, opt);
+		d->Stop();
+		return report;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		auto args = parse(argc, argv);
+		auto& opt = args.storm;
+		auto& pipe = StubPipe(steam_pipe::client);
+		bool lost = false;
+		auto print = [&](const char* mode, const storm_report& report)
+			{
+				PrintStormReport(stdout, mode, report);
+				std::fflush(stdout);
+				lost = lost || report.delivered != report.messages;
+			};
+
+		std::printf("messages=%llu ratio=%.2f payload=%u-%u ids=%u handlers=%u outstanding=%u rate=%u depth=%u%s\n",
+			static_cast<unsigned long long>(opt.messages), opt.callresult_ratio, opt.payload_min, opt.payload_max,
+			opt.callback_ids, opt.handlers, opt.outstanding, opt.rate, opt.depth, opt.post ? " post" : "");
+		PrintStormHeader(stdout);
+
+		if (has_mode(args.modes, "sthread"))
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			sthread_dispatcher d{ steam_pipe::client };
+			print("sthread", RunStorm(d, pipe, opt, [&d] { d.Pump(); }));
+		}
+		if (has_mode(args.modes, "thread"))
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			print("thread", run_mthread(opt, [](mthread_dispatcher& d) { d.Start(false); }));
+		}
+		if (has_mode(args.modes, "readsafe"))
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			print("readsafe", run_mthread(opt, [](mthread_dispatcher& d) { d.Start(true); }));
+		}
+		if (has_mode(args.modes, "pool"))
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			print("pool", run_mthread(opt, [&](mthread_dispatcher& d) { d.Start(pool_options{ args.workers, dispatch_order::per_callback }); }));
+		}
+		if (has_mode(args.modes, "pipeline"))
+		{
+			pipe.Reset(opt.depth, opt.payload_max);
+			print("pipeline", run_mthread(opt, [](mthread_dispatcher& d) { d.Start(pipeline_options{}); }));
+		}
+		return lost ? 1 : 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::fprintf(stderr, "storm_bench: %s\n", e.what());
+		return 2;
+	}
+}
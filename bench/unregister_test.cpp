@@ -0,0 +1,196 @@
+﻿// mthread_dispatcher注销处理器的回归测试，各分发模式都跑一遍，失败时返回1
+// 持续积压：管道一直不空时，其他线程的UnRegisterCallback不能等到积压结束才返回
+// 处理器中注销：同一回调的处理器注销并销毁另一个后，本条消息不能再调用被销毁的那个
+#include "storm.hpp"
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <new>
+#include <string>
+
+using namespace steam;
+using namespace steam::events;
+using namespace steam::events::bench;
+
+namespace
+{
+	constexpr int slow_id = storm_callback_base;
+	constexpr int peer_id = storm_callback_base + 1;
+
+	struct start_mode
+	{
+		const char* name;
+		std::function<void(mthread_dispatcher&)> start;
+	};
+
+	const start_mode modes[] = {
+		{ "thread", [](mthread_dispatcher& d) { d.Start(false); } },
+		{ "readsafe", [](mthread_dispatcher& d) { d.Start(true); } },
+		{ "pool", [](mthread_dispatcher& d) { d.Start(pool_options{ 2, dispatch_order::per_callback }); } },
+		{ "pipeline", [](mthread_dispatcher& d) { d.Start(pipeline_options{}); } },
+	};
+
+	class slow_handler final : public HandlerRecord
+	{
+	public:
+		slow_handler() : HandlerRecord(slow_id, k_uAPICallInvalid) {}
+
+		virtual void Invoke(const void*, bool) override
+		{
+			auto until = std::chrono::steady_clock::now() + std::chrono::microseconds{ 20 };
+			while (std::chrono::steady_clock::now() < until)
+				std::this_thread::yield();
+		}
+	};
+
+	// 记录被销毁后在原地构造，被调用说明分发器用了悬空的指针
+	class tombstone final : public HandlerRecord
+	{
+	private:
+		std::atomic<bool>& touched;
+	public:
+		explicit tombstone(std::atomic<bool>& touched) : HandlerRecord(peer_id, k_uAPICallInvalid), touched(touched) {}
+
+		virtual void Invoke(const void*, bool) override { touched = true; }
+	};
+
+	class peer_killer;
+
+	// 两个peer_killer的存储，被销毁的换成tombstone
+	struct peer_slots
+	{
+		static constexpr std::size_t slot_size = 512u;
+		alignas(std::max_align_t) unsigned char storage[2][slot_size];
+		bool destroyed[2]{};
+
+		peer_killer* at(int index) noexcept { return std::launder(reinterpret_cast<peer_killer*>(storage[index])); }
+	};
+
+	// 先被调用的一个注销并销毁另一个
+	class peer_killer final : public HandlerRecord
+	{
+	private:
+		mthread_dispatcher& d;
+		peer_slots& slots;
+		const int index;
+		std::atomic<bool>& touched;
+		std::atomic<int>& invoked;
+	public:
+		peer_killer(mthread_dispatcher& d, peer_slots& slots, int index, std::atomic<bool>& touched, std::atomic<int>& invoked) :
+			HandlerRecord(peer_id, k_uAPICallInvalid), d(d), slots(slots), index(index), touched(touched), invoked(invoked) {}
+
+		virtual void Invoke(const void*, bool) override
+		{
+			++invoked;
+			int other = 1 - index;
+			if (slots.destroyed[other])
+				return;
+
+			d.UnRegisterCallback(slots.at(other));
+			slots.at(other)->~peer_killer();
+			new (slots.storage[other]) tombstone(touched);
+			slots.destroyed[other] = true;
+		}
+	};
+
+	bool unregister_peer_in_handler(const start_mode& mode)
+	{
+		auto& pipe = StubPipe(steam_pipe::client);
+		pipe.Reset(64u, sizeof(storm_param));
+		auto d = mthread_dispatcher::Create(steam_pipe::client);
+		std::atomic<bool> touched = false;
+		std::atomic<int> invoked = 0;
+
+		static_assert(sizeof(peer_killer) <= peer_slots::slot_size && sizeof(tombstone) <= peer_slots::slot_size);
+		peer_slots slots;
+		for (int i = 0; i < 2; ++i)
+			d->RegisterCallback(*new (slots.storage[i]) peer_killer(*d, slots, i, touched, invoked));
+		mode.start(*d);
+
+		storm_param param{};
+		pipe.PushCallback(1, peer_id, &param, sizeof(param));
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ 5 };
+		while ((pipe.Backlog() || invoked == 0) && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+		std::this_thread::sleep_for(std::chrono::milliseconds{ 20 });
+		d->Stop();
+
+		// 幸存的一个仍登记着
+		int survivors = 0;
+		for (int i = 0; i < 2; ++i)
+		{
+			if (slots.destroyed[i])
+			{
+				std::launder(reinterpret_cast<tombstone*>(slots.storage[i]))->~tombstone();
+				continue;
+			}
+			++survivors;
+			d->UnRegisterCallback(slots.at(i));
+			slots.at(i)->~peer_killer();
+		}
+
+		bool ok = !touched && invoked == 1 && survivors == 1;
+		std::printf("%-9s unregister a peer in a handler: invoked %d, stale call %s %s\n", mode.name, invoked.load(), touched ? "yes" : "no", ok ? "ok" : "FAILED");
+		return ok;
+	}
+
+	// 发生器让管道在backlog内一直有消息，注销应在几条消息之内返回，而不是等发生器停下
+	bool unregister_under_backlog(const start_mode& mode)
+	{
+		auto& pipe = StubPipe(steam_pipe::client);
+		pipe.Reset(1024u, sizeof(storm_param));
+		auto d = mthread_dispatcher::Create(steam_pipe::client);
+		slow_handler slow;
+		d->RegisterCallback(slow);
+		mode.start(*d);
+
+		constexpr auto backlog = std::chrono::milliseconds{ 1000 };
+		std::atomic<bool> stop = false;
+		std::thread producer([&]
+			{
+				storm_param param{};
+				auto until = std::chrono::steady_clock::now() + backlog;
+				while (!stop.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() < until)
+				{
+					if (!pipe.PushCallback(1, slow_id, &param, sizeof(param)))
+						std::this_thread::yield();
+				}
+			});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds{ 100 });
+		slow_handler extra;
+		d->RegisterCallback(extra);
+		auto start = std::chrono::steady_clock::now();
+		d->UnRegisterCallback(&extra);
+		auto blocked = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+		stop = true;
+		producer.join();
+		d->Stop();
+		d->UnRegisterCallback(&slow);
+
+		bool ok = blocked < backlog / 2;
+		std::printf("%-9s unregister under backlog: blocked %lld ms %s\n", mode.name, static_cast<long long>(blocked.count()), ok ? "ok" : "FAILED");
+		return ok;
+	}
+}
+
+int main()
+{
+	try
+	{
+		bool ok = true;
+		for (auto& mode : modes)
+		{
+			ok = unregister_under_backlog(mode) && ok;
+			ok = unregister_peer_in_handler(mode) && ok;
+		}
+		return ok ? 0 : 1;
+	}
+	catch (const std::exception& e)
+	{
+		std::fprintf(stderr, "unregister_test: %s\n", e.what());
+		return 2;
+	}
+}
@@ -0,0 +1,116 @@
+﻿#pragma once
+#include "events.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace steam::events
+{
+	/// <summary>
+	/// 一批同类型的调用结果。每个句柄的记录、结果和完成标志放在同一块连续内存里，整组一次释放
+	/// <para>用法：构造后设置OnAll/OnAny，再dispatcher.RegisterCallresults(group.Records())；</para>
+	/// <para>未全部完成就要销毁时，先dispatcher.UnRegisterCallresults(group.Records())</para>
+	/// <para>线程池模式下各句柄可能在不同线程上完成，OnAll和OnAny只会各调用一次，OnAny先于OnAll；OnAll中可以释放整组</para>
+	/// </summary>
+	template<classic_param T>
+	class callresult_group
+	{
+	public:
+		using all_handler = std::function<void(callresult_group&)>;
+		using any_handler = std::function<void(callresult_group&, std::size_t index)>;
+	private:
+		class member final : public HandlerRecord
+		{
+		public:
+			callresult_group& group;
+			const std::size_t index;
+			callresult<T> result{};
+			std::atomic<bool> done = false;
+
+			member(callresult_group& group, SteamAPICall_t handle, std::size_t index) : HandlerRecord(T::k_iCallback, handle), group(group), index(index) {}
+
+			virtual void Invoke(const void* param, bool iofail) override
+			{
+				// 超时时param为nullptr
+				if (param)
+					result.param = *reinterpret_cast<const T*>(param);
+				result.iofail = iofail || !param;
+				done.store(true, std::memory_order_release);
+				group.complete(index);
+			}
+		};
+
+		struct member_deleter
+		{
+			std::size_t count;
+
+			void operator()(member* p) const noexcept
+			{
+				std::destroy_n(p, count);
+				std::allocator<member>{}.deallocate(p, count);
+			}
+		};
+
+		std::unique_ptr<member[], member_deleter> members;
+		std::vector<HandlerRecord*> records;
+		std::atomic<std::size_t> completed = 0;
+		std::atomic<bool> any_fired = false;
+		all_handler on_all;
+		any_handler on_any;
+
+		void complete(std::size_t index)
+		{
+			if (!any_fired.exchange(true, std::memory_order_acq_rel) && on_any)
+				on_any(*this, index);
+			// 计数之后组可能已被最后完成的线程在OnAll中释放，除最后一个外不能再访问组
+			const auto size = records.size();
+			if (completed.fetch_add(1, std::memory_order_acq_rel) + 1 == size && on_all)
+				on_all(*this);
+		}
+	public:
+		explicit callresult_group(std::span<const SteamAPICall_t> handles) : members(nullptr, member_deleter{ 0 })
+		{
+			std::allocator<member> alloc;
+			member* p = alloc.allocate(handles.size());
+			// 构造不会抛出异常，直接交给unique_ptr
+			for (std::size_t i = 0; i < handles.size(); ++i)
+				std::construct_at(p + i, *this, handles[i], i);
+			members = { p, member_deleter{ handles.size() } };
+
+			records.reserve(handles.size());
+			for (std::size_t i = 0; i < handles.size(); ++i)
+				records.push_back(&members[i]);
+		}
+#pragma region 弃置的构造函数
+		callresult_group(const callresult_group&) = delete;
+		callresult_group(callresult_group&&) = delete;
+#pragma endregion
+
+		/// <summary>
+		/// 全部完成（包括失败和超时）时调用，应在登记前设置
+		/// </summary>
+		void OnAll(all_handler handler) { on_all = std::move(handler); }
+		/// <summary>
+		/// 第一个完成时调用，应在登记前设置
+		/// </summary>
+		void OnAny(any_handler handler) { on_any = std::move(handler); }
+
+		std::span<HandlerRecord* const> Records() const noexcept { return records; }
+
+		std::size_t Size() const noexcept { return records.size(); }
+		/// <summary>
+		/// 已完成的数量
+		/// </summary>
+		std::size_t Completed() const noexcept { return completed.load(std::memory_order_acquire); }
+		bool AllDone() const noexcept { return Completed() == Size(); }
+
+		bool IsDone(std::size_t index) const noexcept { return members[index].done.load(std::memory_order_acquire); }
+		/// <summary>
+		/// 只有IsDone(index)为true时才有意义
+		/// </summary>
+		const callresult<T>& Result(std::size_t index) const noexcept { return members[index].result; }
+		SteamAPICall_t Handle(std::size_t index) const noexcept { return members[index].handle; }
+	};
+}
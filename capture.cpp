@@ -0,0 +1,105 @@
+﻿#include "replay.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+	constexpr steam::uint64 initial_capacity = 1u << 20;
+
+	constexpr steam::uint64 align_up(steam::uint64 n) noexcept
+	{
+		using steam::events::detail::capture_align;
+		return (n + capture_align - 1) / capture_align * capture_align;
+	}
+}
+
+steam::events::detail::capture_log::capture_log(const std::filesystem::path& path)
+{
+	open_file(path);
+	try
+	{
+		map(initial_capacity);
+	}
+	catch (...)
+	{
+		close_file();
+		throw;
+	}
+
+	std::memcpy(view, &capture_magic, sizeof(capture_magic));
+	used = sizeof(capture_magic);
+	start = std::chrono::steady_clock::now();
+}
+
+steam::events::detail::capture_log::~capture_log()
+{
+	unmap();
+	close_file();
+}
+
+void steam::events::detail::capture_log::reserve(uint64 required)
+{
+	if (required <= capacity)
+		return;
+
+	auto size = std::max(capacity, initial_capacity);
+	while (size < required)
+		size *= 2;
+
+	unmap();
+	map(size);
+}
+
+void steam::events::detail::capture_log::append(uint8 kind, int32 user, int callback_typeid, SteamAPICall_t handle, const void* payload, uint32 size, bool iofail)
+{
+	// 末尾留出一个空头部作为结束标记
+	reserve(used + sizeof(capture_record) + align_up(size) + sizeof(capture_record));
+
+	capture_record record{};
+	record.timestamp = static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	record.handle = handle;
+	record.user = user;
+	record.callback_typeid = callback_typeid;
+	record.size = size;
+	record.kind = kind;
+	record.iofail = iofail;
+
+	std::memcpy(view + used, &record, sizeof(record));
+	if (size)
+		std::memcpy(view + used + sizeof(record), payload, size);
+	used += sizeof(record) + align_up(size);
+}
+
+steam::events::replay_log::replay_log(const std::filesystem::path& path)
+{
+	std::ifstream in{ path, std::ios::binary };
+	if (!in)
+		throw std::runtime_error("cannot open capture file");
+
+	in.seekg(0, std::ios::end);
+	data.resize(static_cast<std::size_t>(in.tellg()));
+	in.seekg(0);
+	in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size()));
+
+	uint64 magic = 0;
+	if (data.size() < sizeof(magic) || (std::memcpy(&magic, data.data(), sizeof(magic)), magic != detail::capture_magic))
+		throw std::runtime_error("not a capture file");
+
+	std::size_t offset = sizeof(magic);
+	while (offset + sizeof(detail::capture_record) <= data.size())
+	{
+		detail::capture_record record;
+		std::memcpy(&record, data.data() + offset, sizeof(record));
+		if (record.kind == detail::capture_record::end)
+			break;
+
+		offset += sizeof(record);
+		if (record.size > data.size() - offset)
+			throw std::runtime_error("truncated capture file");
+
+		messages.push_back({ record, data.data() + offset });
+		offset += static_cast<std::size_t>(align_up(record.size));
+	}
+}
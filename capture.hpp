@@ -0,0 +1,63 @@
+﻿#pragma once
+#include "types.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 捕获文件中每条消息的头部，后接size字节参数，按8字节对齐
+	/// <para>文件以capture_magic开头，kind为0的头部表示文件结束（未正常关闭时映射区的剩余部分全为0）</para>
+	/// </summary>
+	struct capture_record
+	{
+		enum : uint8 { end = 0, callback = 1, callresult = 2 };
+
+		// 相对捕获开始的纳秒数
+		uint64 timestamp;
+		// 调用结果的句柄，回调为k_uAPICallInvalid
+		SteamAPICall_t handle;
+		int32 user;
+		int32 callback_typeid;
+		uint32 size;
+		uint8 kind;
+		uint8 iofail;
+		uint16 reserved;
+	};
+	static_assert(sizeof(capture_record) == 32);
+
+	constexpr uint64 capture_magic = 0x3176655f73777473ull; // "stws_ev1"
+	constexpr std::size_t capture_align = 8;
+
+	/// <summary>
+	/// 只追加的内存映射文件，空间不足时扩大文件并重新映射，关闭时截掉未使用的部分。
+	/// 只由分发线程写入，不加锁
+	/// </summary>
+	class capture_log
+	{
+	private:
+		// win32为HANDLE，posix为文件描述符
+		std::intptr_t file = -1;
+		void* mapping = nullptr;
+		uint8* view = nullptr;
+		uint64 capacity = 0;
+		uint64 used = 0;
+		std::chrono::steady_clock::time_point start;
+
+		// win32-captureimpl.cpp和posix-captureimpl.cpp实现，失败时抛出std::system_error
+		void open_file(const std::filesystem::path& path);
+		void map(uint64 size);
+		void unmap() noexcept;
+		void close_file() noexcept;
+
+		void reserve(uint64 required);
+	public:
+		explicit capture_log(const std::filesystem::path& path);
+		capture_log(const capture_log&) = delete;
+		~capture_log();
+
+		void append(uint8 kind, int32 user, int callback_typeid, SteamAPICall_t handle, const void* payload, uint32 size, bool iofail);
+	};
+}
@@ -0,0 +1,41 @@
+﻿#include "coalescer.hpp"
+#include "tables.hpp"
+
+std::size_t steam::events::detail::coalescer::pending_hash::operator()(const pending_key& k) const noexcept
+{
+	return static_cast<std::size_t>(mix64(k.key ^ (static_cast<uint64>(static_cast<uint32>(k.callback_typeid)) << 32)));
+}
+
+void steam::events::detail::coalescer::set(int callback_typeid, key_function key)
+{
+	if (key)
+		policies[callback_typeid] = std::move(key);
+	else
+		policies.erase(callback_typeid);
+}
+
+void steam::events::detail::coalescer::add(int callback_typeid, const void* param, uint32 size)
+{
+	auto key = policies.at(callback_typeid)(param);
+	if (used == entries.size())
+		entries.emplace_back();
+
+	auto [iter, inserted] = index.try_emplace(pending_key{ callback_typeid, key }, used);
+	auto& e = entries[iter->second];
+	try
+	{
+		auto* bytes = static_cast<const uint8*>(param);
+		e.payload.assign(bytes, bytes + size);
+	}
+	catch (...)
+	{
+		// 新键的参数不完整，撤销；旧键保留原来的参数
+		if (inserted)
+			index.erase(iter);
+		throw;
+	}
+
+	e.callback_typeid = callback_typeid;
+	if (inserted)
+		++used;
+}
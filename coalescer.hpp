@@ -0,0 +1,79 @@
+﻿#pragma once
+#include "types.hpp"
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 合并同一轮中的高频回调：对设置了合并策略的回调，按调用者给的键只保留最后一份参数，在本轮结束时按首次出现的顺序交付
+	/// <para>只由分发线程使用，不加锁；参数缓冲区在各轮之间复用</para>
+	/// </summary>
+	class coalescer
+	{
+	public:
+		using key_function = std::function<uint64(const void* param)>;
+	private:
+		struct entry
+		{
+			int callback_typeid;
+			std::vector<uint8> payload;
+		};
+
+		struct pending_key
+		{
+			int callback_typeid;
+			uint64 key;
+
+			bool operator==(const pending_key&) const noexcept = default;
+		};
+
+		struct pending_hash
+		{
+			std::size_t operator()(const pending_key& k) const noexcept;
+		};
+
+		std::unordered_map<int, key_function> policies;
+		std::unordered_map<pending_key, std::size_t, pending_hash> index;
+		std::vector<entry> entries;
+		std::size_t used = 0;
+	public:
+		// key为空时取消合并
+		void set(int callback_typeid, key_function key);
+
+		bool enabled(int callback_typeid) const noexcept
+		{
+			return !policies.empty() && policies.contains(callback_typeid);
+		}
+
+		/// <summary>
+		/// 暂存一份参数，同键的旧参数被覆盖
+		/// </summary>
+		void add(int callback_typeid, const void* param, uint32 size);
+
+		/// <summary>
+		/// deliver(int callback_typeid, const uint8* payload, uint32 size)，交付后清空
+		/// </summary>
+		template<typename F>
+		void flush(F&& deliver)
+		{
+			if (!used)
+				return;
+
+			// deliver中可能再次暂存（例如处理器调用了Pump），先把本轮的参数换出来
+			auto count = used;
+			used = 0;
+			index.clear();
+			std::vector<entry> batch;
+			batch.swap(entries);
+			for (std::size_t i = 0; i < count; ++i)
+				deliver(batch[i].callback_typeid, batch[i].payload.data(), static_cast<uint32>(batch[i].payload.size()));
+
+			// 没有新暂存的参数时换回来，复用缓冲区
+			if (!used)
+				entries.swap(batch);
+		}
+	};
+}
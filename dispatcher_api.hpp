@@ -0,0 +1,11 @@
+﻿#pragma once
+
+#ifdef _MSC_VER
+#ifdef STWKS17EVENTDISPATCHER_EXPORTS
+#define DISPATCHER_API __declspec(dllexport)
+#else
+#define DISPATCHER_API __declspec(dllimport)
+#endif
+#else
+#define DISPATCHER_API
+#endif
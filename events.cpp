@@ -1,278 +1,1332 @@
 ﻿#include "events.hpp"
+#include "steam_imports.hpp"
 #include <thread>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
 
-namespace steam::events::dll
+namespace
 {
-	using HSteamPipe = int32;
-	using HSteamUser = int32;
-	extern "C" __declspec(dllimport) HSteamPipe __cdecl SteamAPI_GetHSteamPipe();
-	extern "C" __declspec(dllimport) HSteamUser __cdecl SteamAPI_GetHSteamUser();
-	extern "C" __declspec(dllimport) HSteamPipe __cdecl SteamGameServer_GetHSteamPipe();
-	extern "C" __declspec(dllimport) HSteamUser __cdecl SteamGameServer_GetHSteamUser();
+#ifdef STWKS20_EVENTS_METRICS
+	constexpr bool metrics_enabled = true;
+#else
+	constexpr bool metrics_enabled = false;
+#endif
 
-	struct CallbackMsg_t
+#ifdef STWKS20_EVENTS_TRACE
+	constexpr bool trace_enabled = true;
+#else
+	constexpr bool trace_enabled = false;
+#endif
+
+	steam::uint64 elapsed_ns(std::chrono::steady_clock::time_point since) noexcept
+	{
+		auto d = std::chrono::steady_clock::now() - since;
+		return static_cast<steam::uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+	}
+
+	/// <summary>
+	/// 正在交给处理器的参数，LeaseParam()从这里租借
+	/// </summary>
+	struct lease_context
 	{
-		int32 m_hSteamUser; // Specific user to whom this callback applies.
-		int m_iCallback; // Callback identifier.  (Corresponds to the k_iCallback enum in the callback structure.)
-		uint8* m_pubParam; // Points to the callback structure
-		int m_cubParam; // Size of the data pointed to by m_pubParam
+		steam::events::detail::param_pool* pool;
+		const void* param;
+		steam::uint32 size;
+		steam::events::param_lease lease;
 	};
 
-	struct SteamAPICallCompleted_t
+	thread_local lease_context* current_param = nullptr;
+
+	/// <summary>
+	/// 在调用处理器期间设置current_param，可以嵌套（处理器内调用Pump）
+	/// </summary>
+	class lease_scope
+	{
+	private:
+		lease_context context;
+		lease_context* previous;
+	public:
+		lease_scope(steam::events::detail::param_pool* pool, const void* param, steam::uint32 size, steam::events::param_lease lease = {}) noexcept
+			: context{ pool, param, size, std::move(lease) }, previous(current_param)
+		{
+			current_param = &context;
+		}
+		lease_scope(const lease_scope&) = delete;
+		~lease_scope() { current_param = previous; }
+	};
+
+	/// <summary>
+	/// 在析构时把这一段记录到trace_sink，sink为空或未启用追踪时什么都不做
+	/// </summary>
+	class trace_scope
+	{
+	private:
+		using sink_t = steam::events::detail::trace_sink;
+		sink_t* sink;
+		sink_t::kind kind;
+		steam::uint64 begin = 0;
+		int callback_typeid;
+		steam::SteamAPICall_t handle;
+		steam::uint32 size;
+	public:
+		trace_scope(sink_t* sink, sink_t::kind kind, int callback_typeid = 0, steam::SteamAPICall_t handle = steam::k_uAPICallInvalid, steam::uint32 size = 0) noexcept
+			: sink(trace_enabled ? sink : nullptr), kind(kind), callback_typeid(callback_typeid), handle(handle), size(size)
+		{
+			if (this->sink)
+				begin = this->sink->now();
+		}
+		trace_scope(const trace_scope&) = delete;
+		~trace_scope()
+		{
+			if (sink)
+				sink->record(kind, begin, callback_typeid, handle, size);
+		}
+
+		// 参数在这一段结束时才知道
+		void set(int id, steam::SteamAPICall_t call, steam::uint32 bytes) noexcept
+		{
+			callback_typeid = id;
+			handle = call;
+			size = bytes;
+		}
+	};
+
+	void run_frame(steam::events::detail::trace_sink* sink, steam::int32 pipe) noexcept
+	{
+		trace_scope span{ sink, steam::events::detail::trace_sink::run_frame };
+		steam::events::dll::SteamAPI_ManualDispatch_RunFrame(pipe);
+	}
+
+	bool next_message(steam::events::detail::trace_sink* sink, steam::int32 pipe, steam::events::dll::CallbackMsg_t& msg) noexcept
+	{
+		trace_scope span{ sink, steam::events::detail::trace_sink::next_callback };
+		if (!steam::events::dll::SteamAPI_ManualDispatch_GetNextCallback(pipe, &msg))
+			return false;
+		span.set(msg.m_iCallback, steam::k_uAPICallInvalid, static_cast<steam::uint32>(msg.m_cubParam));
+		return true;
+	}
+
+	// 线程池模式下正在执行处理器的工作线程所属的分发器
+	thread_local const void* pool_owner = nullptr;
+
+	class snapshot_walk;
+	// 当前线程正在遍历的快照，处理器中再分发时嵌套
+	thread_local snapshot_walk* current_walk = nullptr;
+
+	/// <summary>
+	/// 遍历回调快照期间，本线程上的处理器注销的记录。注销返回后调用者就可能释放记录，
+	/// 快照中排在后面的它本次不能再调用，作用与callback_table::visit的游标相同
+	/// </summary>
+	class snapshot_walk
 	{
-		constexpr static int callback_typeid = 700 + 3;
-		SteamAPICall_t m_hAsyncCall;
-		int m_iCallback;
-		uint32 m_cubParam;
+	private:
+		const void* owner;
+		snapshot_walk* outer;
+		std::vector<const steam::events::HandlerRecord*> removed;
+	public:
+		explicit snapshot_walk(const void* owner) noexcept : owner(owner), outer(current_walk) { current_walk = this; }
+		snapshot_walk(const snapshot_walk&) = delete;
+		~snapshot_walk() { current_walk = outer; }
+
+		bool skips(const steam::events::HandlerRecord* record) const noexcept
+		{
+			return !removed.empty() && std::find(removed.begin(), removed.end(), record) != removed.end();
+		}
+
+		// 本线程上所有遍历owner快照的walk都记下record
+		static void mark(const void* owner, const steam::events::HandlerRecord* record)
+		{
+			try
+			{
+				for (auto* walk = current_walk; walk; walk = walk->outer)
+					if (walk->owner == owner)
+						walk->removed.push_back(record);
+			}
+			catch (...)
+			{
+				unmark(owner, record);
+				throw;
+			}
+		}
+
+		// 注销失败时撤销mark
+		static void unmark(const void* owner, const steam::events::HandlerRecord* record) noexcept
+		{
+			for (auto* walk = current_walk; walk; walk = walk->outer)
+				if (walk->owner == owner && !walk->removed.empty() && walk->removed.back() == record)
+					walk->removed.pop_back();
+		}
 	};
 
-	/// Inform the API that you wish to use manual event dispatch.  This must be called after SteamAPI_Init, but before
-	/// you use any of the other manual dispatch functions below.
-	extern "C" __declspec(dllimport) void __cdecl SteamAPI_ManualDispatch_Init();
+	class idle_backoff
+	{
+	private:
+		const steam::events::idle_options& opt;
+		steam::events::detail::wake_signal& wakeup;
+		steam::uint64 seen;
+		uint32_t rounds = 0;
+		std::chrono::microseconds sleep{ 0 };
+	public:
+		idle_backoff(const steam::events::idle_options& opt, steam::events::detail::wake_signal& wakeup) : opt(opt), wakeup(wakeup), seen(wakeup.current()) {}
+
+		void reset() noexcept
+		{
+			rounds = 0;
+			sleep = std::chrono::microseconds{ 0 };
+		}
+
+		void wait()
+		{
+			if (rounds < opt.spin)
+			{
+				++rounds;
+			}
+			else if (rounds < opt.spin + opt.yield || opt.max_sleep.count() <= 0)
+			{
+				++rounds;
+				std::this_thread::yield();
+			}
+			else
+			{
+				sleep = sleep.count() ? std::min(sleep * 2, opt.max_sleep) : std::min(opt.min_sleep, opt.max_sleep);
+				// 被唤醒时重新从自旋开始
+				if (wakeup.wait_for(sleep, seen))
+					reset();
+			}
+		}
+	};
+}
+
+steam::events::sthread_dispatcher::sthread_dispatcher(steam_pipe pipe) : pipekind(pipe)
+{
+	dll::SteamAPI_ManualDispatch_Init();
+	AllocBuff();
+}
+
+steam::events::sthread_dispatcher::~sthread_dispatcher()
+{
+	Shutdown();
+	FreeBuff();
+	// 回收分发器创建的记录
+	crhandlers.for_each([](HandlerRecord* record)
+		{
+			record->link = {};
+			record->Release();
+		});
+}
+
+void steam::events::sthread_dispatcher::Shutdown() noexcept
+{
+	working = false;
+	wakeup.raise();
+}
+
+void steam::events::sthread_dispatcher::RegisterCallresult(HandlerRecord& handler)
+{
+	crhandlers.insert(&handler);
+}
+
+void steam::events::sthread_dispatcher::RegisterCallresult(HandlerRecord& handler, std::chrono::milliseconds timeout)
+{
+	crhandlers.insert(&handler);
+	if (timeout.count() > 0)
+		timers.schedule(&handler, timeout);
+}
+
+void steam::events::sthread_dispatcher::RegisterCallback(HandlerRecord& handler)
+{
+	cbhandlers.insert(&handler);
+}
+
+void steam::events::sthread_dispatcher::RegisterCallresults(std::span<HandlerRecord* const> handlers)
+{
+	// 预留后insert只会因记录已登记而失败，此时撤销这一批，全部登记或全部不登记
+	crhandlers.reserve(crhandlers.size() + handlers.size());
+	std::size_t inserted = 0;
+	try
+	{
+		for (; inserted < handlers.size(); ++inserted)
+			crhandlers.insert(handlers[inserted]);
+	}
+	catch (...)
+	{
+		while (inserted)
+			crhandlers.erase(handlers[--inserted]);
+		throw;
+	}
+}
+
+void steam::events::sthread_dispatcher::UnRegisterCallresults(std::span<HandlerRecord* const> handlers)
+{
+	for (auto* handler : handlers)
+		UnRegisterCallResult(handler);
+}
+
+void steam::events::sthread_dispatcher::UnRegisterCallResult(HandlerRecord* handler)
+{
+	if (crhandlers.erase(handler))
+	{
+		timers.cancel(handler);
+		handler->Release();
+	}
+}
+
+bool steam::events::sthread_dispatcher::UnRegisterCallResult(const callresult_ticket& ticket)
+{
+	// 先确认记录还在表中，再读它的序号，地址可能已被另一个记录复用
+	if (!ticket || !crhandlers.contains(ticket.handle, ticket.callback_typeid, ticket.record) || ticket.record->Serial() != ticket.serial)
+		return false;
+	UnRegisterCallResult(ticket.record);
+	return true;
+}
+
+void steam::events::sthread_dispatcher::UnRegisterCallback(HandlerRecord* handler)
+{
+	cbhandlers.erase(handler);
+}
+
+steam::events::sthread_dispatcher::EHFunction& steam::events::sthread_dispatcher::EH() { return eh; }
+
+bool steam::events::sthread_dispatcher::IsEHInsatlled() { return (bool)eh; }
+
+steam::events::idle_options& steam::events::sthread_dispatcher::Idle() { return idle; }
+
+steam::int32 steam::events::sthread_dispatcher::ResolvePipe() const noexcept
+{
+	if (pipekind == steam_pipe::gameserver)
+		return dll::SteamGameServer_GetHSteamPipe();
+	return dll::SteamAPI_GetHSteamPipe();
+}
+
+steam::uint32 steam::events::sthread_dispatcher::BufferHighWater() const noexcept { return buffhighwater; }
+
+void steam::events::sthread_dispatcher::EnsureBuff(uint32_t required)
+{
+	if (required > buffhighwater)
+		buffhighwater = required;
+	if (required <= buffsize)
+		return;
+
+	auto size = buffsize;
+	while (size < required)
+		size *= 2u;
+	ResizeBuff(size);
+}
+
+void steam::events::sthread_dispatcher::ResizeBuff(uint32_t size)
+{
+	auto* old = parambuff;
+	auto oldsize = buffsize;
+
+	parambuff = nullptr;
+	buffsize = size;
+	try
+	{
+		AllocBuff();
+	}
+	catch (...)
+	{
+		parambuff = old;
+		buffsize = oldsize;
+		throw;
+	}
+
+	// FreeBuff只认parambuff和buffsize
+	std::swap(parambuff, old);
+	std::swap(buffsize, oldsize);
+	FreeBuff();
+	parambuff = old;
+	buffsize = oldsize;
+}
+
+void steam::events::sthread_dispatcher::TrimBuffer()
+{
+	constexpr uint32_t page = 4096u;
+	auto size = std::max(page, (buffhighwater.load() + page - 1) / page * page);
+	if (size != buffsize)
+		ResizeBuff(size);
+}
+
+void steam::events::sthread_dispatcher::EnableMetrics()
+{
+	if (!metrics)
+		metrics = std::make_unique<detail::metrics_registry>();
+}
+
+void steam::events::sthread_dispatcher::EnableTrace(std::size_t spans_per_thread)
+{
+	if (!tracer)
+		tracer = std::make_unique<detail::trace_sink>(spans_per_thread);
+}
+
+void steam::events::sthread_dispatcher::WriteTrace(const std::filesystem::path& path) const
+{
+	std::ofstream out{ path, std::ios::binary };
+	if (!out)
+		throw std::runtime_error("cannot open trace file");
+
+	if (tracer)
+		tracer->write_json(out);
+	else
+		out << "{\"traceEvents\":[]}\n";
+}
+
+steam::events::metrics_snapshot steam::events::sthread_dispatcher::Metrics() const
+{
+	metrics_snapshot result = metrics ? metrics->snapshot() : metrics_snapshot{};
+	result.outstanding_callresults = crhandlers.size();
+	return result;
+}
+
+void steam::events::sthread_dispatcher::StartCapture(const std::filesystem::path& path)
+{
+	capture.reset();
+	capture = std::make_unique<detail::capture_log>(path);
+}
+
+void steam::events::sthread_dispatcher::StopCapture() noexcept
+{
+	capture.reset();
+}
+
+void steam::events::sthread_dispatcher::CaptureMessage(uint8 kind, int32 user, int callback_typeid, SteamAPICall_t handle, const void* payload, uint32 size, bool iofail) noexcept
+{
+	if (!capture)
+		return;
+
+	try
+	{
+		// 失败的调用结果没有可信的参数
+		capture->append(kind, user, callback_typeid, handle, payload, iofail ? 0 : size, iofail);
+	}
+	catch (const std::exception& e)
+	{
+		capture.reset();
+		if (eh) eh(e);
+	}
+}
+
+void steam::events::sthread_dispatcher::InjectCallback(int callback_typeid, const void* param, uint32 size)
+{
+	DispatchCallback(callback_typeid, param, size, NoteMessage(callback_typeid));
+}
+
+void steam::events::sthread_dispatcher::InjectCallresult(SteamAPICall_t handle, int callback_typeid, const void* param, bool iofail, uint32 size)
+{
+	auto fetched = NoteMessage(callback_typeid);
+	lease_scope scope{ leases.get(), param, size };
+	while (auto* ptr = TakeCallresult(handle, callback_typeid))
+		InvokeHandler(ptr, param, iofail, fetched);
+}
+
+const steam::uint8* steam::events::sthread_dispatcher::FetchCallresult(int32 pipe, SteamAPICall_t handle, int callback_typeid, uint32_t size, bool& iofail, param_lease& lease) noexcept
+{
+	uint8* dest = parambuff;
+	if (leases)
+		lease = param_lease{ leases->acquire(size) };
+
+	if (lease)
+	{
+		dest = const_cast<uint8*>(lease.data());
+	}
+	else
+	{
+		try
+		{
+			EnsureBuff(size);
+		}
+		catch (const std::exception& e)
+		{
+			if (eh) eh(e);
+			iofail = true;
+			return parambuff;
+		}
+		dest = parambuff;
+	}
+
+	trace_scope span{ tracer.get(), detail::trace_sink::fetch_callresult, callback_typeid, handle, size };
+	if (!dll::SteamAPI_ManualDispatch_GetAPICallResult(pipe, handle, dest, static_cast<int>(size), callback_typeid, iofail))
+		iofail = true;
+	return dest;
+}
+
+void steam::events::sthread_dispatcher::EnableParamLeases(std::size_t count, uint32 capacity)
+{
+	leases.reset(new detail::param_pool(count, capacity));
+}
+
+steam::events::param_lease steam::events::sthread_dispatcher::LeaseParam() noexcept
+{
+	auto* context = current_param;
+	if (!context || !context->param)
+		return {};
+
+	if (!context->lease)
+	{
+		if (!context->pool || !context->size)
+			return {};
+		param_lease copy{ context->pool->acquire(context->size) };
+		if (!copy)
+			return {};
+		std::memcpy(const_cast<uint8*>(copy.data()), context->param, context->size);
+		context->lease = std::move(copy);
+	}
+	return context->lease;
+}
+
+steam::events::sthread_dispatcher::metrics_clock::time_point steam::events::sthread_dispatcher::NoteMessage(int callback_typeid) noexcept
+{
+	if constexpr (metrics_enabled)
+	{
+		if (metrics)
+		{
+			metrics->record_message(callback_typeid);
+			return metrics_clock::now();
+		}
+	}
+	return {};
+}
+
+void steam::events::sthread_dispatcher::InvokeHandler(HandlerRecord* handler, const void* param, bool iofail, metrics_clock::time_point fetched) noexcept
+{
+	// 池化的记录在Invoke内释放自己，先把id取出来
+	int callback_typeid = handler->callback_typeid;
+	trace_scope span{ tracer.get(), detail::trace_sink::invoke, callback_typeid, handler->handle, current_param ? current_param->size : 0 };
+	metrics_clock::time_point start;
+	if constexpr (metrics_enabled)
+	{
+		if (metrics && fetched != metrics_clock::time_point{})
+		{
+			start = metrics_clock::now();
+			metrics->record_delay(callback_typeid, elapsed_ns(fetched));
+		}
+	}
+
+	try
+	{
+		handler->Invoke(param, iofail);
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+	}
+
+	if constexpr (metrics_enabled)
+	{
+		if (start != metrics_clock::time_point{})
+			metrics->record_invoke(callback_typeid, elapsed_ns(start));
+	}
+}
+
+void steam::events::sthread_dispatcher::SetCoalescing(int callback_typeid, std::function<uint64(const void* param)> key)
+{
+	coalesce.set(callback_typeid, std::move(key));
+}
+
+bool steam::events::sthread_dispatcher::Coalesce(int callback_typeid, const void* param, uint32 size) noexcept
+{
+	if (!coalesce.enabled(callback_typeid))
+		return false;
+
+	try
+	{
+		coalesce.add(callback_typeid, param, size);
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+		return false;
+	}
+}
+
+void steam::events::sthread_dispatcher::FlushCoalesced() noexcept
+{
+	coalesce.flush([this](int callback_typeid, const uint8* payload, uint32 size)
+		{
+			DispatchCallback(callback_typeid, payload, size);
+		});
+}
+
+bool steam::events::sthread_dispatcher::RouteStatic(int callback_typeid, const void* param) noexcept
+{
+	if (!statics.route)
+		return false;
+
+	try
+	{
+		return statics.route(statics.table, callback_typeid, param);
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+		return true;
+	}
+}
+
+void steam::events::sthread_dispatcher::DispatchCallback(int callback_typeid, const void* param, uint32 size, metrics_clock::time_point fetched) noexcept
+{
+	lease_scope scope{ leases.get(), param, size };
+	if (RouteStatic(callback_typeid, param))
+		return;
+
+	// 处理器可以注销自己或其他处理器
+	cbhandlers.visit(callback_typeid, [&](HandlerRecord* ptr)
+		{
+			InvokeHandler(ptr, param, false, fetched);
+		});
+}
+
+steam::events::HandlerRecord* steam::events::sthread_dispatcher::TakeCallresult(SteamAPICall_t handle, int callback_typeid) noexcept
+{
+	while (auto* record = crhandlers.take(handle, callback_typeid))
+	{
+		// 已撤销的记录由登记队列回收
+		if (!record->post.claim())
+			continue;
+		timers.cancel(record);
+		return record;
+	}
+	return nullptr;
+}
+
+steam::events::HandlerRecord* steam::events::sthread_dispatcher::CollectExpired() noexcept
+{
+	if (timers.empty())
+		return nullptr;
+
+	HandlerRecord* expired = nullptr;
+	HandlerRecord** tail = &expired;
+	for (auto* record = timers.advance(detail::timer_wheel::clock::now()); record;)
+	{
+		auto* next = record->timer.next;
+		crhandlers.erase(record);
+		// 已撤销的记录不调用，由登记队列回收
+		if (record->post.claim())
+		{
+			*tail = record;
+			tail = &record->timer.next;
+		}
+		else
+		{
+			record->timer.next = nullptr;
+		}
+		record = next;
+	}
+	*tail = nullptr;
+	return expired;
+}
+
+void steam::events::sthread_dispatcher::InvokeExpired(HandlerRecord* expired) noexcept
+{
+	while (expired)
+	{
+		// 池化的记录在Invoke内释放自己
+		auto* next = expired->timer.next;
+		expired->timer.next = nullptr;
+		InvokeHandler(expired, nullptr, true);
+		expired = next;
+	}
+}
+
+bool steam::events::sthread_dispatcher::DispatchNext(int32 pipe) noexcept
+{
+	dll::CallbackMsg_t msg;
+	if (!next_message(tracer.get(), pipe, msg))
+		return false;
+
+	if (msg.m_iCallback == dll::SteamAPICallCompleted_t::callback_typeid) [[likely]] // callresult
+	{
+		auto* apicall = reinterpret_cast<dll::SteamAPICallCompleted_t*>(msg.m_pubParam);
+		bool async_iofail = false;
+		auto fetched = NoteMessage(apicall->m_iCallback);
+		param_lease lease;
+		auto* param = FetchCallresult(pipe, apicall->m_hAsyncCall, apicall->m_iCallback, apicall->m_cubParam, async_iofail, lease);
+		CaptureMessage(detail::capture_record::callresult, msg.m_hSteamUser, apicall->m_iCallback, apicall->m_hAsyncCall, param, apicall->m_cubParam, async_iofail);
+
+		// 先从表中取出再调用，处理器内可以安全地登记下一个调用结果
+		lease_scope scope{ leases.get(), param, apicall->m_cubParam, std::move(lease) };
+		while (auto* ptr = TakeCallresult(apicall->m_hAsyncCall, apicall->m_iCallback))
+			InvokeHandler(ptr, param, async_iofail, fetched);
+	}
+	else // callback
+	{
+		CaptureMessage(detail::capture_record::callback, msg.m_hSteamUser, msg.m_iCallback, k_uAPICallInvalid, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), false);
+		auto fetched = NoteMessage(msg.m_iCallback);
+		if (!Coalesce(msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam)))
+			DispatchCallback(msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), fetched);
+	}
+
+	dll::SteamAPI_ManualDispatch_FreeLastCallback(pipe);
+	return true;
+}
+
+void steam::events::sthread_dispatcher::operator()(void) noexcept
+{
+	auto pipe = ResolvePipe();
+	idle_backoff backoff{ idle, wakeup };
+	while (working)
+	{
+		bool busy = false;
+		run_frame(tracer.get(), pipe);
+
+		while (DispatchNext(pipe))
+			busy = true;
+		FlushCoalesced();
+		InvokeExpired(CollectExpired());
+
+		if (busy)
+			backoff.reset();
+		else
+			backoff.wait();
+	}
+}
+
+steam::events::pump_result steam::events::sthread_dispatcher::Pump(const pump_budget& budget) noexcept
+{
+	auto pipe = ResolvePipe();
+	auto deadline = std::chrono::steady_clock::now() + budget.time;
+	pump_result result;
+
+	run_frame(tracer.get(), pipe);
+	for (;;)
+	{
+		if ((budget.messages && result.dispatched >= budget.messages)
+			|| (budget.time.count() > 0 && result.dispatched && std::chrono::steady_clock::now() >= deadline))
+		{
+			result.exhausted = true;
+			break;
+		}
+
+		if (!DispatchNext(pipe))
+			break;
+		++result.dispatched;
+	}
+	FlushCoalesced();
+	InvokeExpired(CollectExpired());
+
+	result.outstanding_callresults = crhandlers.size();
+	return result;
+}
+
+steam::events::mthread_dispatcher* steam::events::mthread_dispatcher::instances[2] = {};
+
+steam::events::mthread_dispatcher::~mthread_dispatcher()
+{
+	Shutdown();
+	for (auto& thread : threads)
+		thread.join();
+
+	// 队列中的记录登记到表中，随表一起回收
+	ApplyPosted();
+	if (auto* hook = stalled.load())
+		hook->owner->Release();
+
+	delete cbsnapshot.load();
+	for (auto& [version, snapshot] : cbretired)
+		delete snapshot;
+}
+
+steam::events::mthread_dispatcher::mthread_dispatcher(steam_pipe pipe) : sthread_dispatcher(pipe)
+{
+	working = false;
+}
+
+void steam::events::mthread_dispatcher::Shutdown() noexcept
+{
+	// 不加锁，处理器中持有crlock时也可以调用
+	sthread_dispatcher::Shutdown();
+}
+
+void steam::events::mthread_dispatcher::InjectCallback(int callback_typeid, const void* param, uint32 size)
+{
+	// 回放期间由当前线程充当分发线程，注销时照常等待它离开快照
+	auto fetched = NoteMessage(callback_typeid);
+	dispatch_thread = std::this_thread::get_id();
+	DispatchSnapshot(callback_typeid, param, size, fetched);
+	cbquiescent = cbversion.load();
+	dispatch_thread = std::thread::id{};
+}
+
+void steam::events::mthread_dispatcher::InjectCallresult(SteamAPICall_t handle, int callback_typeid, const void* param, bool iofail, uint32 size)
+{
+	auto fetched = NoteMessage(callback_typeid);
+	lease_scope scope{ leases.get(), param, size };
+	for (;;)
+	{
+		HandlerRecord* ptr;
+		{
+			std::lock_guard g{ crlock };
+			ptr = TakeCallresult(handle, callback_typeid);
+		}
+		if (!ptr)
+			break;
+		InvokeHandler(ptr, param, iofail, fetched);
+	}
+}
+
+uint64_t steam::events::mthread_dispatcher::PublishCallbacks()
+{
+	const auto* old = cbsnapshot.exchange(new detail::callback_snapshot(cbhandlers));
+	auto version = ++cbversion;
+	if (old)
+		cbretired.emplace_back(version, old);
+
+	ReclaimSnapshots();
+	return version;
+}
+
+void steam::events::mthread_dispatcher::ReclaimSnapshots() noexcept
+{
+	auto quiescent = cbquiescent.load();
+	std::erase_if(cbretired, [quiescent](const auto& retired)
+		{
+			if (retired.first > quiescent)
+				return false;
+			delete retired.second;
+			return true;
+		});
+}
 
-	/// Perform certain periodic actions that need to be performed.
-	extern "C" __declspec(dllimport) void __cdecl SteamAPI_ManualDispatch_RunFrame(HSteamPipe hSteamPipe);
+void steam::events::mthread_dispatcher::WaitForReaders(uint64_t version) noexcept
+{
+	// 在分发线程内注销时不能等自己
+	if (dispatch_thread.load() == std::this_thread::get_id())
+		return;
 
-	/// Fetch the next pending callback on the given pipe, if any.  If a callback is available, true is returned
-	/// and the structure is populated.  In this case, you MUST call SteamAPI_ManualDispatch_FreeLastCallback
-	/// (after dispatching the callback) before calling SteamAPI_ManualDispatch_GetNextCallback again.
-	extern "C" __declspec(dllimport) bool __cdecl SteamAPI_ManualDispatch_GetNextCallback(HSteamPipe hSteamPipe, CallbackMsg_t * pCallbackMsg);
+	// 在本实例的工作线程中注销时，自己的任务要等本函数返回才会结束，只等分发线程和其他任务。
+	// 不读pool成员，分发线程退出时会重置它
+	if (pool_owner == this)
+	{
+		const auto* own = detail::worker_pool::current();
+		while (working && dispatch_thread.load() != std::thread::id{} && (cbdispatched.load() < version || own->oldest_version(true) < version))
+			std::this_thread::sleep_for(std::chrono::microseconds{ 50 });
+		return;
+	}
 
-	/// You must call this after dispatching the callback, if SteamAPI_ManualDispatch_GetNextCallback returns true.
-	extern "C" __declspec(dllimport) void __cdecl SteamAPI_ManualDispatch_FreeLastCallback(HSteamPipe hSteamPipe);
+	while (working && dispatch_thread.load() != std::thread::id{} && cbquiescent.load() < version)
+		std::this_thread::sleep_for(std::chrono::microseconds{ 50 });
+}
 
-	/// Return the call result for the specified call on the specified pipe.  You really should
-	/// only call this in a handler for SteamAPICallCompleted_t callback.
-	extern "C" __declspec(dllimport) bool __cdecl SteamAPI_ManualDispatch_GetAPICallResult(HSteamPipe hSteamPipe, SteamAPICall_t hSteamAPICall, void* pCallback, int cubCallback, int iCallbackExpected, bool& pbFailed);
+void steam::events::mthread_dispatcher::Quiesce() noexcept
+{
+	auto version = cbversion.load();
+	if (pool)
+	{
+		// 工作线程中未完成的任务仍可能引用旧快照
+		cbdispatched = version;
+		cbquiescent = std::min<uint64_t>(version, pool->oldest_version());
+	}
+	else
+	{
+		cbquiescent = version;
+	}
+}
+
+template<bool readsafe>
+void steam::events::mthread_dispatcher::thread_func(void) noexcept
+{
+	// 复制的
+	dll::CallbackMsg_t msg;
+	auto pipe = ResolvePipe();
+	dll::SteamAPICallCompleted_t* apicall = nullptr;
+	bool async_iofail = false;
+	idle_backoff backoff{ idle, wakeup };
+	std::vector<inbound> batch;
+	// 启动时有路由指向本实例则只处理转发来的消息，本次运行中不再改变
+	const bool inboxonly = routed.load() != 0;
+	dispatch_thread = std::this_thread::get_id();
+	while (working)
+	{
+		bool busy = false;
+		ApplyPosted();
+		if (inboxonly) // 只处理转发来的消息
+		{
+			TakeInbox(batch);
+			busy = !batch.empty();
+			for (auto& message : batch)
+			{
+				auto fetched = NoteMessage(message.callback_typeid);
+				const uint8* param = message.lease ? message.lease.data() : message.payload.data();
+				uint32 size = message.lease ? message.lease.size() : static_cast<uint32>(message.payload.size());
+				if (message.handle != k_uAPICallInvalid)
+					DeliverCallresult<readsafe>(message.handle, message.callback_typeid, param, size, message.iofail, std::move(message.lease), fetched);
+				else if (!Coalesce(message.callback_typeid, param, size))
+					DispatchSnapshot(message.callback_typeid, param, size, fetched);
+				Quiesce();
+			}
+			batch.clear();
+		}
+		else
+		{
+			run_frame(tracer.get(), pipe);
+			while (next_message(tracer.get(), pipe, msg))
+			{
+				busy = true;
+				if (msg.m_iCallback == dll::SteamAPICallCompleted_t::callback_typeid) [[likely]] // callresult
+				{
+					apicall = reinterpret_cast<dll::SteamAPICallCompleted_t*>(msg.m_pubParam);
+					param_lease lease;
+					auto* param = FetchCallresult(pipe, apicall->m_hAsyncCall, apicall->m_iCallback, apicall->m_cubParam, async_iofail, lease);
+					CaptureMessage(detail::capture_record::callresult, msg.m_hSteamUser, apicall->m_iCallback, apicall->m_hAsyncCall, param, apicall->m_cubParam, async_iofail);
+					if (!Forward(msg.m_hSteamUser, apicall->m_hAsyncCall, apicall->m_iCallback, param, apicall->m_cubParam, async_iofail, lease))
+					{
+						auto fetched = NoteMessage(apicall->m_iCallback);
+						DeliverCallresult<readsafe>(apicall->m_hAsyncCall, apicall->m_iCallback, param, apicall->m_cubParam, async_iofail, std::move(lease), fetched);
+					}
+				}
+				else // callback
+				{
+					CaptureMessage(detail::capture_record::callback, msg.m_hSteamUser, msg.m_iCallback, k_uAPICallInvalid, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), false);
+					param_lease none;
+					if (!Forward(msg.m_hSteamUser, k_uAPICallInvalid, msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), false, none))
+					{
+						auto fetched = NoteMessage(msg.m_iCallback);
+						if (!Coalesce(msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam)))
+							DispatchSnapshot(msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), fetched);
+					}
+				}
+
+				dll::SteamAPI_ManualDispatch_FreeLastCallback(pipe);
+				Quiesce();
+			}
+		}
+		coalesce.flush([this](int callback_typeid, const uint8* payload, uint32 size)
+			{
+				DispatchSnapshot(callback_typeid, payload, size, {});
+			});
+		ExpireCallresults<readsafe>();
+
+		// 静止点，此后不再引用之前读到的快照
+		Quiesce();
+
+		if (busy)
+			backoff.reset();
+		else
+			backoff.wait();
+	}
+	dispatch_thread = std::thread::id{};
+}
+
+template<bool readsafe>
+void steam::events::mthread_dispatcher::DeliverCallresult(SteamAPICall_t handle, int callback_typeid, const uint8* param, uint32 size, bool iofail, param_lease lease, metrics_clock::time_point fetched) noexcept
+{
+	lease_scope scope{ leases.get(), param, size, std::move(lease) };
+	// 结果可能比本轮开始后才入队的登记先到
+	ApplyPosted();
+	if constexpr (readsafe)
+	{
+		std::lock_guard g{ crlock };
+		while (auto* ptr = TakeCallresult(handle, callback_typeid))
+			InvokeHandler(ptr, param, iofail, fetched);
+	}
+	else
+	{
+		for (;;)
+		{
+			HandlerRecord* ptr;
+			{
+				std::lock_guard g{ crlock };
+				ptr = TakeCallresult(handle, callback_typeid);
+			}
+			if (!ptr)
+				break;
+			InvokeHandler(ptr, param, iofail, fetched);
+		}
+	}
+}
+
+steam::events::mthread_dispatcher* steam::events::mthread_dispatcher::RouteOf(int32 user) noexcept
+{
+	if (!hasroutes.load(std::memory_order_acquire))
+		return nullptr;
+
+	std::lock_guard g{ routelock };
+	auto iter = routes.find(user);
+	return iter == routes.end() ? nullptr : iter->second;
+}
+
+bool steam::events::mthread_dispatcher::Forward(int32 user, SteamAPICall_t handle, int callback_typeid, const void* param, uint32 size, bool iofail, param_lease& lease) noexcept
+{
+	if (!hasroutes.load(std::memory_order_acquire))
+		return false;
+
+	// 持有routelock直到放入收件箱，UnRouteUser返回后不会再有消息转发给原来的目标
+	std::lock_guard route{ routelock };
+	auto iter = routes.find(user);
+	if (iter == routes.end())
+		return false;
+	auto* target = iter->second;
+
+	try
+	{
+		inbound message{ handle, callback_typeid, iofail, std::move(lease), {} };
+		// 租借的缓冲区直接转交，否则复制
+		if (!message.lease)
+		{
+			auto* bytes = static_cast<const uint8*>(param);
+			message.payload.assign(bytes, bytes + size);
+		}
+		bool wake;
+		{
+			std::lock_guard g{ target->inboxlock };
+			wake = target->inbox.empty();
+			target->inbox.push_back(std::move(message));
+		}
+		// 目标可能在空闲中睡眠，收件箱由空变非空时叫醒它
+		if (wake)
+			target->wakeup.raise();
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+	}
+	return true;
 }
 
-steam::events::sthread_dispatcher::sthread_dispatcher()
+void steam::events::mthread_dispatcher::TakeInbox(std::vector<inbound>& batch)
 {
-	dll::SteamAPI_ManualDispatch_Init();
-	AllocBuff();
+	// batch已清空，换过去的容量留给下一批
+	std::lock_guard g{ inboxlock };
+	batch.swap(inbox);
 }
 
-steam::events::sthread_dispatcher::~sthread_dispatcher()
+void steam::events::mthread_dispatcher::DispatchSnapshot(int callback_typeid, const void* param, uint32 size, metrics_clock::time_point fetched) noexcept
 {
-	Shutdown();
-	FreeBuff();
+	lease_scope scope{ leases.get(), param, size };
+	if (RouteStatic(callback_typeid, param))
+		return;
+
+	// 每条消息重新读取快照，前一条消息的处理器可能已经注销并释放了自己
+	if (const auto* snapshot = cbsnapshot.load())
+	{
+		snapshot_walk walk{ this };
+		for (auto* ptr : snapshot->find(callback_typeid))
+			if (!walk.skips(ptr))
+				InvokeHandler(ptr, param, false, fetched);
+	}
 }
 
-void steam::events::sthread_dispatcher::Shutdown() noexcept
+void steam::events::mthread_dispatcher::FillCallbackTask(detail::pool_task& task, int callback_typeid, const void* param, uint32 size)
 {
-	working = false;
+	// 静态表中的回调就地处理，任务为空，不会提交
+	if (RouteStatic(callback_typeid, param))
+		return;
+
+	// 没有处理器时不提交；有的话由工作线程在执行时重新从快照取，排队中的任务不拖住注销
+	const auto* snapshot = cbsnapshot.load();
+	if (!snapshot || snapshot->find(callback_typeid).empty())
+		return;
+
+	task.callback = true;
+	task.callback_typeid = callback_typeid;
+	auto* bytes = static_cast<const uint8*>(param);
+	task.payload.assign(bytes, bytes + size);
 }
 
-void steam::events::sthread_dispatcher::RegisterCallresult(HandlerRecord& handler)
+void steam::events::mthread_dispatcher::SubmitTask(std::unique_ptr<detail::pool_task> task, int callback_typeid, SteamAPICall_t handle) noexcept
 {
-	crhandlers.emplace_front(&handler);
+	auto order = default_order;
+	if (auto iter = orders.find(callback_typeid); iter != orders.end())
+		order = iter->second;
+
+	try
+	{
+		if (order == dispatch_order::per_callback)
+			pool->submit(std::move(task), static_cast<uint32>(callback_typeid));
+		else if (order == dispatch_order::per_call && handle != k_uAPICallInvalid)
+			pool->submit(std::move(task), handle);
+		else
+			pool->submit(std::move(task));
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+	}
 }
 
-void steam::events::sthread_dispatcher::RegisterCallback(HandlerRecord& handler)
+template<bool readsafe>
+void steam::events::mthread_dispatcher::ExpireCallresults(void) noexcept
 {
-	cbhandlers.push_back(&handler);
+	std::unique_lock g{ crlock };
+	auto* expired = CollectExpired();
+	if constexpr (!readsafe)
+		g.unlock();
+	InvokeExpired(expired);
 }
 
-void steam::events::sthread_dispatcher::UnRegisterCallResult(HandlerRecord* handler)
+void steam::events::mthread_dispatcher::SubmitCallresult(SteamAPICall_t handle, int callback_typeid, const uint8* param, uint32 size, bool iofail, param_lease lease, metrics_clock::time_point fetched) noexcept
 {
-	auto next = ++crhandlers.begin();
-	for (auto iter = crhandlers.cbegin(); next != crhandlers.cend(); ++iter, ++next)
-		if (*next == handler)
-			crhandlers.erase_after(iter);
+	try
+	{
+		auto task = std::make_unique<detail::pool_task>();
+		task->fetched = fetched;
+		ApplyPosted();
+		{
+			std::lock_guard g{ crlock };
+			while (auto* ptr = TakeCallresult(handle, callback_typeid))
+				task->handlers.push_back(ptr);
+		}
+		if (task->handlers.empty())
+			return;
+
+		// 租借的缓冲区直接交给工作线程，不再复制
+		if (lease)
+			task->lease = std::move(lease);
+		else
+			task->payload.assign(param, param + size);
+		task->iofail = iofail;
+		SubmitTask(std::move(task), callback_typeid, handle);
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+	}
 }
 
-void steam::events::sthread_dispatcher::UnRegisterCallback(HandlerRecord* handler)
+void steam::events::mthread_dispatcher::SubmitCallback(int callback_typeid, const void* param, uint32 size, metrics_clock::time_point fetched) noexcept
 {
-	for (auto iter = cbhandlers.cbegin(); iter != cbhandlers.cend(); ++iter)
-		if (*iter == handler)
-			cbhandlers.erase(iter);
+	try
+	{
+		auto task = std::make_unique<detail::pool_task>();
+		task->fetched = fetched;
+		FillCallbackTask(*task, callback_typeid, param, size);
+		if (task->callback)
+			SubmitTask(std::move(task), callback_typeid, k_uAPICallInvalid);
+	}
+	catch (const std::exception& e)
+	{
+		if (eh) eh(e);
+	}
 }
 
-steam::events::sthread_dispatcher::EHFunction& steam::events::sthread_dispatcher::EH() { return eh; }
-
-bool steam::events::sthread_dispatcher::IsEHInsatlled() { return (bool)eh; }
-
-void steam::events::sthread_dispatcher::operator()(void) noexcept
+void steam::events::mthread_dispatcher::pooled_thread_func(void) noexcept
 {
 	dll::CallbackMsg_t msg;
-	auto pipe = dll::SteamAPI_GetHSteamPipe();
-	auto* buffer = this->parambuff;
+	auto pipe = ResolvePipe();
 	dll::SteamAPICallCompleted_t* apicall = nullptr;
 	bool async_iofail = false;
+	idle_backoff backoff{ idle, wakeup };
+	std::vector<inbound> batch;
+	// 启动时有路由指向本实例则只处理转发来的消息，本次运行中不再改变
+	const bool inboxonly = routed.load() != 0;
+	dispatch_thread = std::this_thread::get_id();
 	while (working)
 	{
-		dll::SteamAPI_ManualDispatch_RunFrame(pipe);
-
-		while (dll::SteamAPI_ManualDispatch_GetNextCallback(pipe, &msg))
+		bool busy = false;
+		ApplyPosted();
+		if (inboxonly) // 只处理转发来的消息
+		{
+			TakeInbox(batch);
+			busy = !batch.empty();
+			for (auto& message : batch)
+			{
+				auto fetched = NoteMessage(message.callback_typeid);
+				const uint8* param = message.lease ? message.lease.data() : message.payload.data();
+				uint32 size = message.lease ? message.lease.size() : static_cast<uint32>(message.payload.size());
+				if (message.handle != k_uAPICallInvalid)
+					SubmitCallresult(message.handle, message.callback_typeid, param, size, message.iofail, std::move(message.lease), fetched);
+				else if (!Coalesce(message.callback_typeid, param, size))
+					SubmitCallback(message.callback_typeid, param, size, fetched);
+				Quiesce();
+			}
+			batch.clear();
+		}
+		else
 		{
-			if (msg.m_iCallback == dll::SteamAPICallCompleted_t::callback_typeid) [[likely]] // callresult
+			run_frame(tracer.get(), pipe);
+			while (next_message(tracer.get(), pipe, msg))
 			{
-				apicall = reinterpret_cast<dll::SteamAPICallCompleted_t*>(msg.m_pubParam);
-				dll::SteamAPI_ManualDispatch_GetAPICallResult(
-					pipe,
-					apicall->m_hAsyncCall,
-					this->parambuff,
-					apicall->m_cubParam,
-					apicall->m_iCallback,
-					async_iofail
-				);
-
-				auto next = ++crhandlers.begin();
-				for (auto iter = crhandlers.cbegin(); next != crhandlers.cend(); ++iter, ++next)
+				busy = true;
+				// 参数复制到任务中后才归还steam的消息
+				if (msg.m_iCallback == dll::SteamAPICallCompleted_t::callback_typeid) [[likely]] // callresult
 				{
-					auto* ptr = *iter;
-					if (ptr->handle == apicall->m_hAsyncCall &&
-						ptr->callback_typeid == apicall->m_iCallback)
+					apicall = reinterpret_cast<dll::SteamAPICallCompleted_t*>(msg.m_pubParam);
+					param_lease lease;
+					auto* param = FetchCallresult(pipe, apicall->m_hAsyncCall, apicall->m_iCallback, apicall->m_cubParam, async_iofail, lease);
+					CaptureMessage(detail::capture_record::callresult, msg.m_hSteamUser, apicall->m_iCallback, apicall->m_hAsyncCall, param, apicall->m_cubParam, async_iofail);
+					if (!Forward(msg.m_hSteamUser, apicall->m_hAsyncCall, apicall->m_iCallback, param, apicall->m_cubParam, async_iofail, lease))
 					{
-						try
-						{
-							ptr->Invoke(buffer, async_iofail);
-						}
-						catch (const std::exception& e)
-						{
-							if (eh) eh(e);
-						}
+						auto fetched = NoteMessage(apicall->m_iCallback);
+						SubmitCallresult(apicall->m_hAsyncCall, apicall->m_iCallback, param, apicall->m_cubParam, async_iofail, std::move(lease), fetched);
 					}
-					crhandlers.erase_after(iter);
 				}
-			}
-			else // callback
-			{
-				for (auto iter = cbhandlers.begin(); iter != cbhandlers.end(); ++iter)
+				else // callback
 				{
-					auto ptr = *iter;
-					if (ptr->callback_typeid == msg.m_iCallback)
+					CaptureMessage(detail::capture_record::callback, msg.m_hSteamUser, msg.m_iCallback, k_uAPICallInvalid, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), false);
+					param_lease none;
+					if (!Forward(msg.m_hSteamUser, k_uAPICallInvalid, msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), false, none))
 					{
-						try
-						{
-							ptr->Invoke(msg.m_pubParam, false);
-						}
-						catch (const std::exception& e)
-						{
-							if (eh) eh(e);
-						}
+						auto fetched = NoteMessage(msg.m_iCallback);
+						if (!Coalesce(msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam)))
+							SubmitCallback(msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam), fetched);
 					}
 				}
-			}
 
-			dll::SteamAPI_ManualDispatch_FreeLastCallback(pipe);
+				dll::SteamAPI_ManualDispatch_FreeLastCallback(pipe);
+				Quiesce();
+			}
 		}
-	}
-}
 
-steam::events::mthread_dispatcher* steam::events::mthread_dispatcher::instance = nullptr;
+		coalesce.flush([this](int callback_typeid, const uint8* payload, uint32 size)
+			{
+				SubmitCallback(callback_typeid, payload, size, {});
+			});
 
-steam::events::mthread_dispatcher::~mthread_dispatcher()
-{
-	Shutdown();
+		// 超时的调用结果直接在本线程调用
+		ExpireCallresults<false>();
+
+		Quiesce();
+
+		if (busy)
+			backoff.reset();
+		else
+			backoff.wait();
+	}
+
+	// 执行完剩余任务
+	pool.reset();
+	cbquiescent = cbversion.load();
+	dispatch_thread = std::thread::id{};
 }
 
-steam::events::mthread_dispatcher::mthread_dispatcher()
+void steam::events::mthread_dispatcher::Stage(int32 pipe, int32 user, int message_typeid, const uint8* message, uint32 message_size) noexcept
 {
-	working = false;
+	bool callresult = message_typeid == dll::SteamAPICallCompleted_t::callback_typeid;
+	auto* apicall = callresult ? reinterpret_cast<const dll::SteamAPICallCompleted_t*>(message) : nullptr;
+	int callback_typeid = callresult ? apicall->m_iCallback : message_typeid;
+	SteamAPICall_t handle = callresult ? apicall->m_hAsyncCall : k_uAPICallInvalid;
+	uint32 size = callresult ? apicall->m_cubParam : message_size;
+
+	// 转发给其他实例的消息不经过缓冲区
+	bool iofail = false;
+	param_lease lease;
+	// 取出后路由被撤销时，已取出的参数照常写入缓冲区
+	const void* prefetched = nullptr;
+	if (RouteOf(user))
+	{
+		const void* param = message;
+		if (callresult)
+			param = FetchCallresult(pipe, handle, callback_typeid, size, iofail, lease);
+		CaptureMessage(callresult ? detail::capture_record::callresult : detail::capture_record::callback, user, callback_typeid, handle, param, size, iofail);
+		if (Forward(user, handle, callback_typeid, param, size, iofail, lease))
+			return;
+		prefetched = param;
+	}
+
+	detail::staged_record* record = nullptr;
+	bool waited = false;
+	for (;;)
+	{
+		try
+		{
+			record = stage->reserve(size);
+		}
+		catch (const std::exception& e)
+		{
+			if (eh) eh(e);
+			return;
+		}
+		if (record || !working)
+			break;
+		if (!waited)
+		{
+			stage->note_overflow();
+			waited = true;
+		}
+		std::this_thread::yield();
+	}
+	if (!record)
+		return;
+
+	record->handle = handle;
+	record->callback_typeid = callback_typeid;
+	record->fetched = NoteMessage(callback_typeid).time_since_epoch().count();
+	if (prefetched)
+	{
+		std::memcpy(record->data(), prefetched, size);
+		record->kind = callresult ? detail::staged_record::callresult : detail::staged_record::callback;
+	}
+	else if (callresult)
+	{
+		// 调用结果直接取到缓冲区中
+		trace_scope span{ tracer.get(), detail::trace_sink::fetch_callresult, callback_typeid, handle, size };
+		if (!dll::SteamAPI_ManualDispatch_GetAPICallResult(pipe, handle, record->data(), static_cast<int>(size), callback_typeid, iofail))
+			iofail = true;
+		record->kind = detail::staged_record::callresult;
+	}
+	else
+	{
+		std::memcpy(record->data(), message, size);
+		record->kind = detail::staged_record::callback;
+	}
+	record->iofail = iofail;
+	if (!prefetched)
+		CaptureMessage(callresult ? detail::capture_record::callresult : detail::capture_record::callback, user, callback_typeid, handle, record->data(), size, iofail);
+	stage->commit();
 }
 
-void steam::events::mthread_dispatcher::Shutdown() noexcept
+void steam::events::mthread_dispatcher::staged_drain_func(void) noexcept
 {
-	std::lock_guard<std::mutex> a{ crlock }, b{ cblock };
-	sthread_dispatcher::Shutdown();
+	dll::CallbackMsg_t msg;
+	auto pipe = ResolvePipe();
+	idle_backoff backoff{ idle, wakeup };
+	while (working)
+	{
+		bool busy = false;
+		run_frame(tracer.get(), pipe);
+		while (working && next_message(tracer.get(), pipe, msg))
+		{
+			busy = true;
+			Stage(pipe, msg.m_hSteamUser, msg.m_iCallback, msg.m_pubParam, static_cast<uint32>(msg.m_cubParam));
+			dll::SteamAPI_ManualDispatch_FreeLastCallback(pipe);
+		}
+
+		if (busy)
+			backoff.reset();
+		else
+			backoff.wait();
+	}
 }
 
 template<bool readsafe>
-void steam::events::mthread_dispatcher::thread_func(void) noexcept
+void steam::events::mthread_dispatcher::staged_dispatch_func(void) noexcept
 {
-	// 复制的
-	dll::CallbackMsg_t msg;
-	auto pipe = dll::SteamAPI_GetHSteamPipe();
-	auto* buffer = this->parambuff;
-	dll::SteamAPICallCompleted_t* apicall = nullptr;
-	bool async_iofail = false;
+	idle_backoff backoff{ idle, wakeup };
+	dispatch_thread = std::this_thread::get_id();
 	while (working)
 	{
-		dll::SteamAPI_ManualDispatch_RunFrame(pipe);
-		while (dll::SteamAPI_ManualDispatch_GetNextCallback(pipe, &msg))
+		bool busy = false;
+		ApplyPosted();
+		while (auto* record = stage->front())
 		{
-			if (msg.m_iCallback == dll::SteamAPICallCompleted_t::callback_typeid) [[likely]] // callresult
+			busy = true;
+			metrics_clock::time_point fetched{ metrics_clock::duration{ record->fetched } };
+			const uint8* param = record->data();
+			if (record->kind == detail::staged_record::callresult)
+				DeliverCallresult<readsafe>(record->handle, record->callback_typeid, param, record->size, record->iofail != 0, {}, fetched);
+			else if (!Coalesce(record->callback_typeid, param, record->size))
+				DispatchSnapshot(record->callback_typeid, param, record->size, fetched);
+			stage->pop();
+			Quiesce();
+		}
+		coalesce.flush([this](int callback_typeid, const uint8* payload, uint32 size)
 			{
-				apicall = reinterpret_cast<dll::SteamAPICallCompleted_t*>(msg.m_pubParam);
-				dll::SteamAPI_ManualDispatch_GetAPICallResult(
-					pipe,
-					apicall->m_hAsyncCall,
-					this->parambuff,
-					apicall->m_cubParam,
-					apicall->m_iCallback,
-					async_iofail
-				);
-				if constexpr(readsafe)
-				{
-					std::lock_guard g{ crlock };
-					auto next = ++crhandlers.begin();// noex
-					for (auto iter = crhandlers.cbegin(); next != crhandlers.cend(); ++iter, ++next) //noex
-					{
-						auto* ptr = *iter;// noex
-						if (ptr->handle == apicall->m_hAsyncCall &&
-							ptr->callback_typeid == apicall->m_iCallback)
-						{
-							try //noex
-							{
-								ptr->Invoke(buffer, async_iofail);
-							}
-							catch (const std::exception& e)
-							{
-								if (eh) eh(e);
-							}
-						}
-
-						crhandlers.erase_after(iter);
-					}
-				}
-				else
-				{
-					auto next = ++crhandlers.begin();// noex
-					for (auto iter = crhandlers.cbegin(); next != crhandlers.cend(); ++iter, ++next) //noex
-					{
-						auto* ptr = *iter;// noex
-						if (ptr->handle == apicall->m_hAsyncCall &&
-							ptr->callback_typeid == apicall->m_iCallback)
-						{
-							try //noex
-							{
-								ptr->Invoke(buffer, async_iofail);
-							}
-							catch (const std::exception& e)
-							{
-								if (eh) eh(e);
-							}
-						}
-						std::lock_guard g{ crlock };
-						crhandlers.erase_after(iter);
-					}
+				DispatchSnapshot(callback_typeid, payload, size, {});
+			});
+		ExpireCallresults<readsafe>();
 
-				}
-			}
-			else // callback
-			{
-				for (auto iter = cbhandlers.begin(); iter != cbhandlers.end(); ++iter)
-				{
-					auto ptr = *iter;
-					if (ptr->callback_typeid == msg.m_iCallback)
-					{
-						try
-						{
-							ptr->Invoke(msg.m_pubParam, false);
-						}
-						catch (const std::exception& e)
-						{
-							if (eh) eh(e);
-						}
-					}
-				}
-			}
+		// 静止点，此后不再引用之前读到的快照
+		Quiesce();
 
-			dll::SteamAPI_ManualDispatch_FreeLastCallback(pipe);
-		}
-		std::this_thread::yield();
+		if (busy)
+			backoff.reset();
+		else
+			backoff.wait();
 	}
+	dispatch_thread = std::thread::id{};
 }
 
 void steam::events::mthread_dispatcher::operator()(void) noexcept { thread_func<false>(); }
@@ -284,10 +1338,134 @@ void steam::events::mthread_dispatcher::RegisterCallresult(HandlerRecord& handle
 	sthread_dispatcher::RegisterCallresult(handler);
 }
 
+void steam::events::mthread_dispatcher::RegisterCallresult(HandlerRecord& handler, std::chrono::milliseconds timeout)
+{
+	std::lock_guard guard{ crlock };
+	sthread_dispatcher::RegisterCallresult(handler, timeout);
+}
+
+void steam::events::mthread_dispatcher::RegisterCallresults(std::span<HandlerRecord* const> handlers)
+{
+	std::lock_guard guard{ crlock };
+	sthread_dispatcher::RegisterCallresults(handlers);
+}
+
+void steam::events::mthread_dispatcher::UnRegisterCallresults(std::span<HandlerRecord* const> handlers)
+{
+	std::lock_guard guard{ crlock };
+	sthread_dispatcher::UnRegisterCallresults(handlers);
+}
+
 void steam::events::mthread_dispatcher::RegisterCallback(HandlerRecord& handler)
 {
 	std::lock_guard guard{ cblock };
 	sthread_dispatcher::RegisterCallback(handler);
+	try
+	{
+		PublishCallbacks();
+	}
+	catch (...)
+	{
+		sthread_dispatcher::UnRegisterCallback(&handler);
+		throw;
+	}
+}
+
+void steam::events::mthread_dispatcher::PostCallresult(HandlerRecord& handler, std::chrono::milliseconds timeout) noexcept
+{
+	auto& hook = handler.post;
+	hook.owner = &handler;
+	hook.timeout = static_cast<uint32>(std::clamp<std::chrono::milliseconds::rep>(timeout.count(), 0, UINT32_MAX));
+	hook.state.store(detail::post_hook::queued, std::memory_order_relaxed);
+	posts.push(&hook);
+}
+
+bool steam::events::mthread_dispatcher::CancelCallresult(HandlerRecord& handler) noexcept
+{
+	auto& hook = handler.post;
+	auto state = hook.state.load(std::memory_order_acquire);
+	for (;;)
+	{
+		if (state == detail::post_hook::queued)
+		{
+			// 还在队列中，分发线程取出时会看到撤销
+			if (hook.state.compare_exchange_weak(state, detail::post_hook::cancelled, std::memory_order_acq_rel))
+				return true;
+		}
+		else if (state == detail::post_hook::armed)
+		{
+			// 已在表中，重新入队由分发线程移除
+			if (hook.state.compare_exchange_weak(state, detail::post_hook::cancelled, std::memory_order_acq_rel))
+			{
+				posts.push(&hook);
+				return true;
+			}
+		}
+		else
+		{
+			return false;
+		}
+	}
+}
+
+void steam::events::mthread_dispatcher::ApplyPosted() noexcept
+{
+	if (!stalled.load(std::memory_order_relaxed) && posts.empty())
+		return;
+
+	std::lock_guard g{ crlock };
+	ApplyPostedLocked();
+}
+
+void steam::events::mthread_dispatcher::ApplyPostedLocked() noexcept
+{
+	for (;;)
+	{
+		auto* hook = stalled.exchange(nullptr, std::memory_order_relaxed);
+		if (!hook)
+			hook = posts.pop();
+		if (!hook)
+		{
+			if (posts.empty())
+				break;
+			// 某个生产者push到一半，它之后入队的登记要等它写完next才能取到，
+			// 这里不等的话，紧接着到达的调用结果会找不到处理器
+			std::this_thread::yield();
+			continue;
+		}
+
+		auto* record = hook->owner;
+		if (hook->state.load(std::memory_order_acquire) == detail::post_hook::queued)
+		{
+			try
+			{
+				sthread_dispatcher::RegisterCallresult(*record, std::chrono::milliseconds{ hook->timeout });
+			}
+			catch (const std::invalid_argument& e)
+			{
+				// 记录已登记在其他表中，重试也不会成功，丢弃这次登记
+				if (eh) eh(e);
+				hook->state.store(detail::post_hook::idle, std::memory_order_release);
+				continue;
+			}
+			catch (const std::exception& e)
+			{
+				if (eh) eh(e);
+				stalled.store(hook, std::memory_order_relaxed);
+				break;
+			}
+
+			// 登记期间可能被撤销
+			uint8 expected = detail::post_hook::queued;
+			if (hook->state.compare_exchange_strong(expected, detail::post_hook::armed, std::memory_order_acq_rel))
+				continue;
+		}
+
+		// 已撤销，可能已被TakeCallresult或CollectExpired移出表
+		crhandlers.erase(record);
+		timers.cancel(record);
+		record->Release();
+	}
 }
 
 void steam::events::mthread_dispatcher::UnRegisterCallResult(HandlerRecord* handler)
@@ -296,37 +1474,231 @@ void steam::events::mthread_dispatcher::UnRegisterCallResult(HandlerRecord* hand
 	sthread_dispatcher::UnRegisterCallResult(handler);
 }
 
+bool steam::events::mthread_dispatcher::UnRegisterCallResult(const callresult_ticket& ticket)
+{
+	std::lock_guard g{ crlock };
+	// 经PostCallresult<T>登记的记录可能还在队列中，入队先于拿到凭据，应用后它要么在表中，要么已回收
+	ApplyPostedLocked();
+	return sthread_dispatcher::UnRegisterCallResult(ticket);
+}
+
 void steam::events::mthread_dispatcher::UnRegisterCallback(HandlerRecord* handler)
 {
-	std::lock_guard g{ cblock };
-	sthread_dispatcher::UnRegisterCallback(handler);
+	// 在处理器中注销时，本线程正在遍历的快照可能还排着handler。WaitForReaders不等本线程自己，先让这次遍历跳过它
+	snapshot_walk::mark(this, handler);
+	uint64_t version;
+	try
+	{
+		std::lock_guard g{ cblock };
+		sthread_dispatcher::UnRegisterCallback(handler);
+		version = PublishCallbacks();
+	}
+	catch (...)
+	{
+		snapshot_walk::unmark(this, handler);
+		throw;
+	}
+	// 返回后调用者可以释放handler
+	WaitForReaders(version);
+}
+
+void steam::events::mthread_dispatcher::SetDispatchOrder(int callback_typeid, dispatch_order order)
+{
+	orders[callback_typeid] = order;
 }
 
-void steam::events::mthread_dispatcher::Initialize()
+void steam::events::mthread_dispatcher::Initialize(steam_pipe pipe)
 {
+	auto*& instance = instances[static_cast<int>(pipe)];
 	if (!instance)
-		instance = new mthread_dispatcher();
+		instance = new mthread_dispatcher(pipe);
+}
+
+void steam::events::mthread_dispatcher::StartThread(bool readSafe, steam_pipe pipe)
+{
+	Initialize(pipe);
+	instances[static_cast<int>(pipe)]->Start(readSafe);
+}
+
+void steam::events::mthread_dispatcher::StartThread(const pool_options& options, steam_pipe pipe)
+{
+	Initialize(pipe);
+	instances[static_cast<int>(pipe)]->Start(options);
+}
+
+std::unique_ptr<steam::events::mthread_dispatcher> steam::events::mthread_dispatcher::Create(steam_pipe pipe)
+{
+	return std::unique_ptr<mthread_dispatcher>{ new mthread_dispatcher(pipe) };
+}
+
+void steam::events::mthread_dispatcher::Spawn(detail::os_thread& thread, void (mthread_dispatcher::* func)(void) noexcept, const char* name_suffix)
+{
+	thread_options options = threadopts;
+	if (!options.name.empty())
+		options.name += name_suffix;
+	thread.start(options, [this, func] { (this->*func)(); });
+}
+
+void steam::events::mthread_dispatcher::Reap()
+{
+	for (auto& thread : threads)
+		if (!thread.join_for(std::chrono::milliseconds{ 0 }))
+			throw std::runtime_error("the previous dispatcher thread is still running");
 }
 
-void steam::events::mthread_dispatcher::StartThread(bool readSafe)
+bool steam::events::mthread_dispatcher::Stop(std::chrono::milliseconds timeout) noexcept
 {
-	Initialize();
-	if (!instance->working)
+	Shutdown();
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	bool quiesced = true;
+	for (auto& thread : threads)
 	{
-		instance->working = true;
-		if (readSafe)
-			std::thread{ &mthread_dispatcher::ReadSafeThreadFunction, instance }.detach();
-		else
-			std::thread{ &mthread_dispatcher::operator(), instance }.detach();
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (!thread.join_for(std::max(left, std::chrono::milliseconds{ 0 })))
+			quiesced = false;
+	}
+	return quiesced;
+}
+
+void steam::events::mthread_dispatcher::SetThreadOptions(const thread_options& options)
+{
+	threadopts = options;
+}
+
+void steam::events::mthread_dispatcher::Start(bool readSafe)
+{
+	if (!working)
+	{
+		Reap();
+		working = true;
+		try
+		{
+			Spawn(threads[0], readSafe ? &mthread_dispatcher::ReadSafeThreadFunction : &mthread_dispatcher::operator());
+		}
+		catch (...)
+		{
+			working = false;
+			throw;
+		}
+	}
+}
+
+void steam::events::mthread_dispatcher::Start(const pool_options& options)
+{
+	if (!working)
+	{
+		Reap();
+		pool = std::make_unique<detail::worker_pool>(options.workers, cbversion, [this](detail::pool_task& task)
+			{
+				const uint8* param = task.lease ? task.lease.data() : task.payload.data();
+				uint32 size = task.lease ? task.lease.size() : static_cast<uint32>(task.payload.size());
+				lease_scope scope{ leases.get(), param, size, task.lease };
+				pool_owner = this;
+				if (!task.callback)
+				{
+					for (auto* ptr : task.handlers)
+						InvokeHandler(ptr, param, task.iofail, task.fetched);
+				}
+				else if (const auto* snapshot = cbsnapshot.load()) // 池已登记了task.version，快照不会早于它
+				{
+					snapshot_walk walk{ this };
+					for (auto* ptr : snapshot->find(task.callback_typeid))
+						if (!walk.skips(ptr))
+							InvokeHandler(ptr, param, false, task.fetched);
+				}
+			});
+		default_order = options.order;
+		working = true;
+		try
+		{
+			Spawn(threads[0], &mthread_dispatcher::pooled_thread_func);
+		}
+		catch (...)
+		{
+			working = false;
+			pool.reset();
+			throw;
+		}
+	}
+}
+
+void steam::events::mthread_dispatcher::StartThread(const pipeline_options& options, steam_pipe pipe)
+{
+	Initialize(pipe);
+	instances[static_cast<int>(pipe)]->Start(options);
+}
+
+void steam::events::mthread_dispatcher::Start(const pipeline_options& options)
+{
+	if (routed)
+	{
+		Start(options.readsafe);
+		return;
+	}
+
+	if (!working)
+	{
+		Reap();
+		stage = std::make_unique<detail::staged_ring>(options.capacity);
+		working = true;
+		try
+		{
+			Spawn(threads[1], &mthread_dispatcher::staged_drain_func, "-in");
+			if (options.readsafe)
+				Spawn(threads[0], &mthread_dispatcher::staged_dispatch_func<true>);
+			else
+				Spawn(threads[0], &mthread_dispatcher::staged_dispatch_func<false>);
+		}
+		catch (...)
+		{
+			// 第一阶段可能已经启动
+			Shutdown();
+			threads[1].join();
+			throw;
+		}
 	}
 }
-steam::events::mthread_dispatcher& steam::events::mthread_dispatcher::Get()
+
+steam::events::pipeline_stats steam::events::mthread_dispatcher::PipelineStats() const
+{
+	return stage ? stage->stats() : pipeline_stats{};
+}
+
+void steam::events::mthread_dispatcher::RouteUser(int32 user, mthread_dispatcher& target)
+{
+	if (&target == this)
+		throw std::invalid_argument("cannot route a user to the source dispatcher");
+
+	std::lock_guard g{ routelock };
+	auto& route = routes[user];
+	if (route == &target)
+		return;
+	if (route)
+		--route->routed;
+	++target.routed;
+	route = &target;
+	hasroutes.store(true, std::memory_order_release);
+}
+
+void steam::events::mthread_dispatcher::UnRouteUser(int32 user)
+{
+	std::lock_guard g{ routelock };
+	auto iter = routes.find(user);
+	if (iter == routes.end())
+		return;
+	--iter->second->routed;
+	routes.erase(iter);
+	hasroutes.store(!routes.empty(), std::memory_order_release);
+}
+
+steam::events::mthread_dispatcher& steam::events::mthread_dispatcher::Get(steam_pipe pipe)
 {
-	return *instance;
+	return *instances[static_cast<int>(pipe)];
 }
 
-void steam::events::mthread_dispatcher::Destory()
+void steam::events::mthread_dispatcher::Destory(steam_pipe pipe)
 {
+	auto*& instance = instances[static_cast<int>(pipe)];
 	delete instance;
 	instance = nullptr;
 }
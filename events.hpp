@@ -1,21 +1,30 @@
 ﻿#pragma once
-
-#ifdef _MSC_VER
-#ifdef STWKS17EVENTDISPATCHER_EXPORTS
-#define DISPATCHER_API __declspec(dllexport)
-#else
-#define DISPATCHER_API __declspec(dllimport)
-#endif
-#else
-#define DISPATCHER_API
-#endif
-
-
+#include "dispatcher_api.hpp"
 #include "types.hpp"
+#include "tables.hpp"
+#include "worker_pool.hpp"
+#include "record_slab.hpp"
+#include "metrics.hpp"
+#include "capture.hpp"
+#include "timer_wheel.hpp"
+#include "coalescer.hpp"
+#include "param_pool.hpp"
+#include "post_queue.hpp"
+#include "staged_ring.hpp"
+#include "trace.hpp"
+#include "os_thread.hpp"
 #include <functional>
 #include <concepts>
+#include <chrono>
+#include <coroutine>
+#include <new>
+#include <span>
+#include <type_traits>
 #include <mutex>
-#include <forward_list>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 namespace steam::events
 {
 	template <typename T>
@@ -37,7 +46,7 @@ namespace steam::events
 	classic_param<ParamT>;
 
 	template<typename T, typename ParamT>
-	concept callback_handler = requires (T & handler, ParamT * param)
+	concept callback_handler = requires (T & handler, const ParamT * param)
 	{
 		{handler.HandleCallback(param) }->std::same_as<void>;
 	} &&
@@ -52,10 +61,73 @@ namespace steam::events
 
 		const int callback_typeid;
 		const SteamAPICall_t handle;
+		// 登记在分发器的处理器表中时使用
+		detail::list_hook link;
+		// 登记了超时的调用结果挂在分发器的时间轮上
+		detail::timer_hook timer;
+		// 经mthread_dispatcher::PostCallresult登记时挂在登记队列上
+		detail::post_hook post;
 
 		virtual void Invoke(const void* param, bool iofail) = 0;
+		/// <summary>
+		/// 调用结果记录未触发就被注销，或分发器析构时仍未触发，由分发器调用。调用者自己管理的记录什么都不做
+		/// <para>Invoke之后分发器不再访问记录，由分发器持有的记录在Invoke末尾自行回收</para>
+		/// </summary>
+		virtual void Release() noexcept {}
+		/// <summary>
+		/// 分发器创建的记录在该分发器内的序号，从1开始；调用者自己管理的记录为0
+		/// </summary>
+		virtual uint64 Serial() const noexcept { return 0; }
 		DISPATCHER_API virtual ~HandlerRecord() = default;
 	};
+}
+
+namespace steam::events::detail
+{
+	// 以下模板需要完整的HandlerRecord
+
+	template<typename F>
+	void callresult_table::for_each(F&& f) const
+	{
+		for (std::size_t i = 0; heads && i <= mask; ++i)
+		{
+			for (auto* record = heads[i]; record;)
+			{
+				auto* next = record->link.next;
+				f(record);
+				record = next;
+			}
+		}
+	}
+
+	template<typename F>
+	void callback_table::visit(int callback_typeid, F&& f)
+	{
+		const bucket* b = find(callback_typeid);
+		if (!b)
+			return;
+
+		cursor c{ b->head, cursors };
+		cursors = &c;
+		try
+		{
+			while (auto* record = c.next)
+			{
+				c.next = record->link.next;
+				f(record);
+			}
+		}
+		catch (...)
+		{
+			cursors = c.outer;
+			throw;
+		}
+		cursors = c.outer;
+	}
+}
+
+namespace steam::events
+{
 
 	/// <summary>
 	/// 
@@ -81,48 +153,458 @@ namespace steam::events
 		virtual ~LambdaHandler() override = default;
 	};
 
+	/// <summary>
+	/// 把处理器对象直接存放在记录里，不经过std::function，也不分配内存
+	/// <para>H满足result_handler时调用HandleResult，否则调用HandleCallback</para>
+	/// </summary>
+	template <classic_param T, typename H>
+		requires result_handler<H, T> || callback_handler<H, T>
+	class TypedHandler final : public HandlerRecord
+	{
+	private:
+		H handler;
+	public:
+		TypedHandler(SteamAPICall_t handle, H&& handler) : HandlerRecord(T::k_iCallback, handle), handler(std::move(handler)) {}
+		/// <summary>
+		/// 用于回调
+		/// </summary>
+		explicit TypedHandler(H&& handler) : HandlerRecord(T::k_iCallback, k_uAPICallInvalid), handler(std::move(handler)) {}
+#pragma region 弃置的构造函数
+		TypedHandler() = delete;
+		TypedHandler(const TypedHandler&) = delete;
+		TypedHandler(TypedHandler&&) = delete;
+#pragma endregion
+
+		H& Get() noexcept { return handler; }
+
+		virtual void Invoke(const void* param, bool iofail) override
+		{
+			const T* p = reinterpret_cast<const T*>(param);
+			if constexpr (result_handler<H, T>)
+				handler.HandleResult(iofail, p);
+			else
+				handler.HandleCallback(p);
+		}
+		virtual ~TypedHandler() override = default;
+	};
+
+	/// <summary>
+	/// 由分发器创建并持有的调用结果记录，内存来自分发器的record_slab，触发后自动回收
+	/// </summary>
+	template <classic_param T, typename F>
+		requires std::invocable<F&, const T*, bool>
+	class PooledHandler final : public HandlerRecord
+	{
+	private:
+		detail::record_slab& slab;
+		const uint64 serial;
+		F handler;
+	public:
+		PooledHandler(detail::record_slab& slab, uint64 serial, SteamAPICall_t handle, F&& handler) : HandlerRecord(T::k_iCallback, handle), slab(slab), serial(serial), handler(std::move(handler)) {}
+		PooledHandler(detail::record_slab& slab, uint64 serial, SteamAPICall_t handle, const F& handler) : HandlerRecord(T::k_iCallback, handle), slab(slab), serial(serial), handler(handler) {}
+		PooledHandler(const PooledHandler&) = delete;
+
+		virtual uint64 Serial() const noexcept override { return serial; }
+
+		virtual void Invoke(const void* param, bool iofail) override
+		{
+			// 调用结果只触发一次，处理器抛出异常也要回收
+			struct release_guard
+			{
+				PooledHandler* self;
+				~release_guard() { self->Release(); }
+			} guard{ this };
+
+			handler(reinterpret_cast<const T*>(param), iofail);
+		}
+
+		virtual void Release() noexcept override
+		{
+			auto& owner = slab;
+			this->~PooledHandler();
+			owner.deallocate(this, sizeof(PooledHandler));
+		}
+	};
+
+	/// <summary>
+	/// CreateCallresult返回的凭据，记录触发、超时或注销后仍可安全使用
+	/// <para>只用于比对，分发器在表中找到同一地址且序号相同的记录时才会访问它，块被复用后也不会误注销其他记录</para>
+	/// </summary>
+	struct callresult_ticket
+	{
+		SteamAPICall_t handle = k_uAPICallInvalid;
+		int callback_typeid = 0;
+		HandlerRecord* record = nullptr;
+		uint64 serial = 0;
+
+		explicit operator bool() const noexcept { return record != nullptr; }
+	};
+
+	/// <summary>
+	/// co_await得到的调用结果，iofail为true时param未定义
+	/// </summary>
+	template<classic_param T>
+	struct callresult
+	{
+		T param;
+		bool iofail;
+	};
+
+	/// <summary>
+	/// <para>auto [param, iofail] = co_await dispatcher.result&lt;T&gt;(hCall);</para>
+	/// <para>等待体本身就是登记记录，存放在协程帧里，不额外分配内存。协程在分发线程上恢复</para>
+	/// <para>mthread_dispatcher的ReadSafeThreadFunction持锁调用处理器，恢复后的协程不能再登记调用结果</para>
+	/// </summary>
+	template<classic_param T, typename Dispatcher>
+	class callresult_awaiter final : public HandlerRecord
+	{
+	private:
+		Dispatcher& dispatcher;
+		std::coroutine_handle<> waiting;
+		callresult<T> result{};
+	public:
+		callresult_awaiter(Dispatcher& dispatcher, SteamAPICall_t handle) : HandlerRecord(T::k_iCallback, handle), dispatcher(dispatcher) {}
+		callresult_awaiter(const callresult_awaiter&) = delete;
+
+		// 无效句柄不会有结果，直接以iofail返回
+		bool await_ready() const noexcept { return handle == k_uAPICallInvalid; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			waiting = h;
+			// 登记之后协程可能已在分发线程上恢复，不能再访问this
+			dispatcher.RegisterCallresult(*this);
+		}
+
+		callresult<T> await_resume() noexcept
+		{
+			if (handle == k_uAPICallInvalid)
+				result.iofail = true;
+			return result;
+		}
+
+		virtual void Invoke(const void* param, bool iofail) override
+		{
+			if (param)
+				result.param = *reinterpret_cast<const T*>(param);
+			result.iofail = iofail;
+			waiting.resume();
+		}
+	};
+
+	/// <summary>
+	/// 分发循环空闲时的等待策略：先自旋spin轮，再yield轮，之后睡眠，
+	/// 睡眠时间从min_sleep开始翻倍，直到max_sleep
+	/// <para>max_sleep即空闲时的最大唤醒延迟，设为0则只自旋和yield</para>
+	/// </summary>
+	struct idle_options
+	{
+		uint32_t spin = 64u;
+		uint32_t yield = 64u;
+		std::chrono::microseconds min_sleep{ 50 };
+		std::chrono::microseconds max_sleep{ 2000 };
+	};
+
+	/// <summary>
+	/// Pump()的预算，为0的项不限制
+	/// </summary>
+	struct pump_budget
+	{
+		std::chrono::microseconds time{ 0 };
+		uint32_t messages = 0u;
+	};
+
+	struct pump_result
+	{
+		// 本次分发的消息数
+		uint32_t dispatched = 0u;
+		// 预算用完时队列里可能还有消息，应在下一帧继续
+		bool exhausted = false;
+		// 登记了但尚未触发的调用结果
+		std::size_t outstanding_callresults = 0;
+	};
+
+	/// <summary>
+	/// 分发器轮询的管道，游戏服务器与客户端各有一个管道，互不影响
+	/// </summary>
+	enum class steam_pipe
+	{
+		// SteamAPI_GetHSteamPipe()
+		client,
+		// SteamGameServer_GetHSteamPipe()
+		gameserver,
+	};
+
 	/// <summary>
 	/// 适用于使用steamworks api的小工具，如下载mod
+	/// <para>每个实例只轮询一个管道，有自己的参数缓冲区和处理器表</para>
 	/// </summary>
 	class sthread_dispatcher
 	{
 	protected:
-		std::forward_list<HandlerRecord*> crhandlers;
-		std::vector<HandlerRecord*> cbhandlers;
+		detail::callresult_table crhandlers;
+		detail::callback_table cbhandlers;
 		unsigned char* parambuff = nullptr;
-		uint32_t buffsize = 4096u * 4u;// 4*4K
+		uint32_t buffsize = 4096u * 4u;// 4*4K，调用结果更大时翻倍
+		std::atomic<uint32_t> buffhighwater = 0;
 
-		bool working = true;
+		std::atomic<bool> working = true;
+		const steam_pipe pipekind;
+		// 分发循环开始时取管道句柄，此时游戏服务器应已初始化
+		int32 ResolvePipe() const noexcept;
 
 		// 所有平台都必须实现
-		// void AllocBuff()，该函数分配4*4K的连续内存，用于接收steam事件参数
+		// void AllocBuff()，该函数分配buffsize字节的连续内存，用于接收steam事件参数
 		// void FreeBuff()，该函数释放AllocBuff分配的缓冲区
-		// 建议一次性分配4个连续的4K分页
+		// win32-allocimpl.cpp使用VirtualAlloc，posix-allocimpl.cpp使用mmap
 		void AllocBuff();
 		void FreeBuff();
+		// 保证缓冲区至少有required字节，并更新最大用量
+		void EnsureBuff(uint32_t required);
+		void ResizeBuff(uint32_t size);
+		// 取出调用结果，返回参数所在的位置：启用了租约且池中有空闲缓冲区时取到lease中，否则取到parambuff；失败时iofail为true
+		const uint8* FetchCallresult(int32 pipe, SteamAPICall_t handle, int callback_typeid, uint32_t size, bool& iofail, param_lease& lease) noexcept;
 
 		std::function<void(const std::exception&)> eh;
+		idle_options idle;
+		// 打断空闲等待中的睡眠，Shutdown()时触发
+		detail::wake_signal wakeup;
+		detail::record_slab slab;
+		// EnableMetrics()之前为空
+		std::unique_ptr<detail::metrics_registry> metrics;
+		// EnableTrace()之前为空
+		std::unique_ptr<detail::trace_sink> tracer;
+
+		using metrics_clock = std::chrono::steady_clock;
+		// StartCapture()之前为空
+		std::unique_ptr<detail::capture_log> capture;
+		// 带超时的调用结果
+		detail::timer_wheel timers;
+
+		// AttachStatic挂上的static_dispatcher
+		struct static_route
+		{
+			bool (*route)(void* table, int callback_typeid, const void* param) = nullptr;
+			void* table = nullptr;
+		} statics;
+
+		// SetCoalescing设置的回调在一轮结束时交付
+		detail::coalescer coalesce;
+		// EnableParamLeases()之前为空
+		std::unique_ptr<detail::param_pool, detail::param_pool::closer> leases;
+		// 分发器创建的记录的序号，CreateCallresult可能在多个线程同时调用
+		std::atomic<uint64> pooledserial = 0;
+
+		template<classic_param T, typename F>
+		HandlerRecord* MakePooled(SteamAPICall_t handle, F&& handler)
+		{
+			using record_t = PooledHandler<T, std::decay_t<F>>;
+			static_assert(alignof(record_t) <= detail::record_slab::block_align);
+
+			void* block = slab.allocate(sizeof(record_t));
+			try
+			{
+				return new (block) record_t(slab, pooledserial.fetch_add(1, std::memory_order_relaxed) + 1, handle, std::forward<F>(handler));
+			}
+			catch (...)
+			{
+				slab.deallocate(block, sizeof(record_t));
+				throw;
+			}
+		}
+
+		// 统计一条消息，返回取出消息的时间，未启用统计时为默认值
+		metrics_clock::time_point NoteMessage(int callback_typeid) noexcept;
+		// 调用处理器，异常转交给eh；fetched为取出消息的时间，用于统计延迟
+		void InvokeHandler(HandlerRecord* handler, const void* param, bool iofail, metrics_clock::time_point fetched = {}) noexcept;
+		// 调用所有订阅了callback_typeid的处理器
+		void DispatchCallback(int callback_typeid, const void* param, uint32 size, metrics_clock::time_point fetched = {}) noexcept;
+		// 需要合并时暂存参数并返回true；暂存失败时报告给eh，返回false照常分发
+		bool Coalesce(int callback_typeid, const void* param, uint32 size) noexcept;
+		// 交付本轮暂存的回调
+		void FlushCoalesced() noexcept;
+		// 交给静态回调表，返回false表示不在表中；异常转交给eh
+		bool RouteStatic(int callback_typeid, const void* param) noexcept;
+		// 捕获中则把消息写入文件，写入失败时报告给eh并停止捕获
+		void CaptureMessage(uint8 kind, int32 user, int callback_typeid, SteamAPICall_t handle, const void* payload, uint32 size, bool iofail) noexcept;
+		// 取出并分发一条消息，队列为空时返回false
+		bool DispatchNext(int32 pipe) noexcept;
+		// 从表中取出调用结果，同时取消它的超时
+		HandlerRecord* TakeCallresult(SteamAPICall_t handle, int callback_typeid) noexcept;
+		// 推进时间轮，返回到期的记录（以timer.next串联），它们已从表中移除
+		HandlerRecord* CollectExpired() noexcept;
+		// 以param为nullptr、iofail为true调用到期的记录
+		void InvokeExpired(HandlerRecord* expired) noexcept;
 	public:
 		using EHFunction = std::function<void(const std::exception&)>;
 
 		void operator()(void) noexcept;
 
-		DISPATCHER_API sthread_dispatcher();
+		/// <summary>
+		/// 不阻塞的单帧分发：调用RunFrame，然后分发消息直到队列为空或预算用完
+		/// <para>时间预算在每条消息之前检查，至少分发一条消息，因此单个处理器的耗时可能超出预算</para>
+		/// </summary>
+		DISPATCHER_API pump_result Pump(const pump_budget& budget = {}) noexcept;
+
+		DISPATCHER_API sthread_dispatcher(steam_pipe pipe = steam_pipe::client);
 		DISPATCHER_API ~sthread_dispatcher();
 
 		DISPATCHER_API void Shutdown() noexcept;
 		DISPATCHER_API EHFunction& EH();
 		DISPATCHER_API bool IsEHInsatlled();
 
+		/// <summary>
+		/// 空闲策略，应在分发循环启动前修改
+		/// </summary>
+		DISPATCHER_API idle_options& Idle();
+
+		/// <summary>
+		/// 迄今最大的调用结果字节数
+		/// </summary>
+		DISPATCHER_API uint32 BufferHighWater() const noexcept;
+		/// <summary>
+		/// 把参数缓冲区缩小到BufferHighWater()按页取整的大小，只能在分发循环停止时调用
+		/// </summary>
+		DISPATCHER_API void TrimBuffer();
+
+		/// <summary>
+		/// 开始收集每种回调的消息数、处理器耗时和延迟，应在分发循环启动前调用
+		/// <para>只有定义了STWKS20_EVENTS_METRICS编译的库才会记录，否则快照中只有未完成的调用结果数</para>
+		/// </summary>
+		DISPATCHER_API void EnableMetrics();
+		/// <summary>
+		/// 统计数据的快照，可以在任何线程调用
+		/// </summary>
+		DISPATCHER_API metrics_snapshot Metrics() const;
+
+		/// <summary>
+		/// 开始记录RunFrame、GetNextCallback、GetAPICallResult和每次Invoke的时间线，每个线程最多记录spans_per_thread段，之后丢弃
+		/// <para>只有定义了STWKS20_EVENTS_TRACE编译的库才会记录。应在分发循环启动前调用，已启用时不做任何事</para>
+		/// </summary>
+		DISPATCHER_API void EnableTrace(std::size_t spans_per_thread = std::size_t{ 1 } << 16);
+		/// <summary>
+		/// 把已记录的时间线写成Chrome trace event JSON，可用chrome://tracing或Perfetto打开；记录期间也可以调用
+		/// </summary>
+		DISPATCHER_API void WriteTrace(const std::filesystem::path& path) const;
+
+		/// <summary>
+		/// 把此后收到的每条消息和调用结果参数写入path，文件格式见capture.hpp，用replay_log回放
+		/// <para>应在分发循环停止时调用，已在捕获时先关闭原来的文件</para>
+		/// </summary>
+		DISPATCHER_API void StartCapture(const std::filesystem::path& path);
+		/// <summary>
+		/// 关闭捕获文件，应在分发循环停止时调用
+		/// </summary>
+		DISPATCHER_API void StopCapture() noexcept;
+
+		/// <summary>
+		/// 不经过steam，在当前线程把回调交给处理器，用于回放；size为0时处理器不能租借参数
+		/// </summary>
+		DISPATCHER_API void InjectCallback(int callback_typeid, const void* param, uint32 size = 0);
+		/// <summary>
+		/// 不经过steam，在当前线程触发登记在handle上的调用结果，用于回放
+		/// </summary>
+		DISPATCHER_API void InjectCallresult(SteamAPICall_t handle, int callback_typeid, const void* param, bool iofail, uint32 size = 0);
+
+		/// <summary>
+		/// 启用参数租约：预先分配count块、每块capacity字节的引用计数缓冲区，应在分发循环启动前调用
+		/// <para>不超过capacity的调用结果直接取到空闲缓冲区中，处理器用LeaseParam()免复制地保留参数</para>
+		/// </summary>
+		DISPATCHER_API void EnableParamLeases(std::size_t count, uint32 capacity);
+		/// <summary>
+		/// 在处理器内调用，租借当前参数，租约可以交给其他线程。
+		/// 回调参数在第一次租借时复制到池中，同一条消息的处理器共用这一份
+		/// <para>未启用、池已耗尽、参数超过容量或不在处理器内时返回空租约，此时需要自行复制</para>
+		/// </summary>
+		DISPATCHER_API static param_lease LeaseParam() noexcept;
+
+		/// <summary>
+		/// 挂上static_dispatcher，其中的回调类型不再查找登记的处理器。应在分发循环启动前调用，table须比分发循环存活更久
+		/// <para>线程池模式下静态表在轮询线程上执行</para>
+		/// </summary>
+		template<typename Table>
+		void AttachStatic(Table& table) noexcept { statics = { &Table::Route, &table }; }
+		void DetachStatic() noexcept { statics = {}; }
+
+		/// <summary>
+		/// 合并高频回调：同一轮收到的callback_typeid回调中，key(param)相同的只交付最后一份，在本轮收完消息后交付；key为空时取消
+		/// <para>合并的回调会晚于同一轮中其他消息交付。应在分发循环启动前调用</para>
+		/// </summary>
+		DISPATCHER_API void SetCoalescing(int callback_typeid, std::function<uint64(const void* param)> key);
+
+		/// <summary>
+		/// key(const T*)返回合并用的键，例如steam id
+		/// </summary>
+		template<classic_param T, typename F>
+			requires std::invocable<F&, const T*>
+		void SetCoalescing(F key)
+		{
+			SetCoalescing(T::k_iCallback, [key = std::move(key)](const void* param) mutable -> uint64
+				{
+					return static_cast<uint64>(key(reinterpret_cast<const T*>(param)));
+				});
+		}
+
 		DISPATCHER_API void RegisterCallresult(HandlerRecord& handler);
+		/// <summary>
+		/// 登记调用结果，超过timeout仍未完成时以param为nullptr、iofail为true调用并移除；timeout为0表示不限时
+		/// <para>超时在分发循环每轮收完消息后检查，精度为1毫秒加上一轮的时间</para>
+		/// </summary>
+		DISPATCHER_API void RegisterCallresult(HandlerRecord& handler, std::chrono::milliseconds timeout);
 		DISPATCHER_API void RegisterCallback(HandlerRecord& handler);
+		/// <summary>
+		/// 一次登记一批调用结果，要么全部登记，要么抛出异常且一个也不登记
+		/// </summary>
+		DISPATCHER_API void RegisterCallresults(std::span<HandlerRecord* const> handlers);
 
 		DISPATCHER_API void UnRegisterCallResult(HandlerRecord* handler);
+		/// <summary>
+		/// 注销CreateCallresult创建的记录，返回是否注销成功；记录已经触发、超时或被注销时返回false
+		/// </summary>
+		DISPATCHER_API bool UnRegisterCallResult(const callresult_ticket& ticket);
 		DISPATCHER_API void UnRegisterCallback(HandlerRecord* handler);
+		/// <summary>
+		/// 注销一批调用结果，已经触发的跳过
+		/// </summary>
+		DISPATCHER_API void UnRegisterCallresults(std::span<HandlerRecord* const> handlers);
+
+		/// <summary>
+		/// 等待调用结果
+		/// </summary>
+		template<classic_param T>
+		callresult_awaiter<T, sthread_dispatcher> result(SteamAPICall_t handle) { return { *this, handle }; }
+
+		/// <summary>
+		/// 由分发器创建并登记调用结果记录，handler(const T*, bool iofail)，触发、超时或注销后记录自动回收
+		/// <para>返回的凭据可以随时交给UnRegisterCallResult，记录已回收时什么都不做</para>
+		/// </summary>
+		template<classic_param T, typename F>
+			requires std::invocable<F&, const T*, bool>
+		callresult_ticket CreateCallresult(SteamAPICall_t handle, F&& handler, std::chrono::milliseconds timeout = {})
+		{
+			auto* record = MakePooled<T>(handle, std::forward<F>(handler));
+			callresult_ticket ticket{ handle, record->callback_typeid, record, record->Serial() };
+			try
+			{
+				RegisterCallresult(*record, timeout);
+			}
+			catch (...)
+			{
+				record->Release();
+				throw;
+			}
+			return ticket;
+		}
 	};
 
 	/// <summary>
-	/// 
+	/// 在独立线程上分发。回调处理器以快照形式发布：分发线程无锁读取当前快照，
+	/// 登记和注销在cblock下生成新快照，旧快照等分发线程越过静止点后回收。
+	/// 每条消息之后都是静止点，注销只等正在执行的处理器，不等积压的消息。
+	/// 处理器中注销的记录由本线程的遍历跳过，不依赖快照
+	/// <para>以StartThread(const pool_options&amp;)启动时，分发线程只负责取消息并复制参数，</para>
+	/// <para>处理器在工作线程池中执行，此时eh可能被多个线程同时调用；回调任务开始执行时才从快照取处理器，</para>
+	/// <para>调用结果的HandlerRecord在被调用前不可释放</para>
 	/// </summary>
 	class mthread_dispatcher final : private sthread_dispatcher
 	{
@@ -130,38 +612,276 @@ namespace steam::events
 		std::mutex crlock;
 		std::mutex cblock;
 
+		std::atomic<const detail::callback_snapshot*> cbsnapshot = nullptr;
+		std::atomic<uint64_t> cbversion = 0;
+		// 分发线程已不再引用版本号不超过此值的旧快照
+		std::atomic<uint64_t> cbquiescent = 0;
+		// 线程池模式：分发线程自己已不再引用版本号不超过此值的旧快照，不计工作线程
+		std::atomic<uint64_t> cbdispatched = 0;
+		// cblock保护
+		std::vector<std::pair<uint64_t, const detail::callback_snapshot*>> cbretired;
+		std::atomic<std::thread::id> dispatch_thread;
+
+		// 需持有cblock
+		uint64_t PublishCallbacks();
+		void ReclaimSnapshots() noexcept;
+		void WaitForReaders(uint64_t version) noexcept;
+		// 分发线程在每条消息之后调用，发布静止点，注销不必等整批消息分发完
+		void Quiesce() noexcept;
+
+		std::unique_ptr<detail::worker_pool> pool;
+		dispatch_order default_order = dispatch_order::per_callback;
+		std::unordered_map<int, dispatch_order> orders;
+
+		void pooled_thread_func(void) noexcept;
+
 		template<bool readsafe>
 		void thread_func(void) noexcept;
-		mthread_dispatcher();
+		template<bool readsafe>
+		void ExpireCallresults(void) noexcept;
+		// 交给静态表或当前快照中的处理器
+		void DispatchSnapshot(int callback_typeid, const void* param, uint32 size, metrics_clock::time_point fetched) noexcept;
+		// 线程池模式：复制回调参数和处理器到任务中，静态表中的回调就地处理
+		void FillCallbackTask(detail::pool_task& task, int callback_typeid, const void* param, uint32 size);
+		// 线程池模式：按顺序策略提交，失败时报告给eh
+		void SubmitTask(std::unique_ptr<detail::pool_task> task, int callback_typeid, SteamAPICall_t handle) noexcept;
+		// 取出调用结果的处理器后调用或提交到线程池
+		template<bool readsafe>
+		void DeliverCallresult(SteamAPICall_t handle, int callback_typeid, const uint8* param, uint32 size, bool iofail, param_lease lease, metrics_clock::time_point fetched) noexcept;
+		void SubmitCallresult(SteamAPICall_t handle, int callback_typeid, const uint8* param, uint32 size, bool iofail, param_lease lease, metrics_clock::time_point fetched) noexcept;
+		void SubmitCallback(int callback_typeid, const void* param, uint32 size, metrics_clock::time_point fetched) noexcept;
 
-		static mthread_dispatcher* instance;
+		/// <summary>
+		/// 转发给其他实例的消息，handle为k_uAPICallInvalid表示回调
+		/// </summary>
+		struct inbound
+		{
+			SteamAPICall_t handle;
+			int callback_typeid;
+			bool iofail;
+			param_lease lease;
+			std::vector<uint8> payload;
+		};
+		std::mutex inboxlock;
+		std::vector<inbound> inbox;
+		// 指向本实例的路由数，routelock保护修改。启动时不为0则本次运行不读取管道，只处理inbox
+		std::atomic<uint32_t> routed = 0;
+
+		std::mutex routelock;
+		std::unordered_map<int32, mthread_dispatcher*> routes;
+		std::atomic<bool> hasroutes = false;
+
+		// 按m_hSteamUser转发给目标实例，返回是否已转发（即使复制失败）；租借的参数被移走
+		bool Forward(int32 user, SteamAPICall_t handle, int callback_typeid, const void* param, uint32 size, bool iofail, param_lease& lease) noexcept;
+		mthread_dispatcher* RouteOf(int32 user) noexcept;
+		void TakeInbox(std::vector<inbound>& batch);
+
+		// 流水线模式：第一阶段写入、第二阶段读取
+		std::unique_ptr<detail::staged_ring> stage;
+		void staged_drain_func(void) noexcept;
+		template<bool readsafe>
+		void staged_dispatch_func(void) noexcept;
+		// 把一条消息写入stage，缓冲区满时等待
+		void Stage(int32 pipe, int32 user, int message_typeid, const uint8* message, uint32 message_size) noexcept;
+
+		detail::post_queue posts;
+		// 上一轮登记失败的记录，下一轮先重试它。crlock保护修改，原子的只是为了不加锁判断是否为空
+		std::atomic<detail::post_hook*> stalled = nullptr;
+		// 应用登记队列中的登记和撤销。分发线程每轮开始时调用，按凭据注销时也在调用线程上调用
+		void ApplyPosted() noexcept;
+		// 同ApplyPosted，需持有crlock；出队由crlock串行化
+		void ApplyPostedLocked() noexcept;
+
+		thread_options threadopts;
+		// 0号为分发线程，1号为流水线模式的第一阶段线程
+		detail::os_thread threads[2];
+		// 按threadopts启动线程，name_suffix附加在线程名后
+		void Spawn(detail::os_thread& thread, void (mthread_dispatcher::* func)(void) noexcept, const char* name_suffix = "");
+		// 回收上次启动的线程，仍在运行时抛出std::runtime_error
+		void Reap();
+
+		mthread_dispatcher(steam_pipe pipe);
+
+		// 每个管道一个实例，以steam_pipe为下标
+		static mthread_dispatcher* instances[2];
 
 	public:
+		/// <summary>
+		/// 通知线程退出并等待它们结束，不能在处理器中销毁分发器
+		/// </summary>
 		DISPATCHER_API ~mthread_dispatcher();
 
 		using sthread_dispatcher::EHFunction;
 		using sthread_dispatcher::EH;
 		using sthread_dispatcher::IsEHInsatlled;
+		using sthread_dispatcher::Idle;
+		using sthread_dispatcher::BufferHighWater;
+		using sthread_dispatcher::TrimBuffer;
+		using sthread_dispatcher::EnableMetrics;
+		using sthread_dispatcher::EnableTrace;
+		using sthread_dispatcher::WriteTrace;
+		using sthread_dispatcher::StartCapture;
+		using sthread_dispatcher::StopCapture;
+		using sthread_dispatcher::AttachStatic;
+		using sthread_dispatcher::DetachStatic;
+		using sthread_dispatcher::SetCoalescing;
+		using sthread_dispatcher::EnableParamLeases;
+		using sthread_dispatcher::LeaseParam;
+		using sthread_dispatcher::Metrics;
+
+		/// <summary>
+		/// 同sthread_dispatcher::InjectCallback，不能与分发线程同时运行
+		/// </summary>
+		DISPATCHER_API void InjectCallback(int callback_typeid, const void* param, uint32 size = 0);
+		DISPATCHER_API void InjectCallresult(SteamAPICall_t handle, int callback_typeid, const void* param, bool iofail, uint32 size = 0);
 
+		/// <summary>
+		/// 通知分发线程退出并唤醒空闲中的线程，不等待。可以在处理器中调用
+		/// </summary>
 		DISPATCHER_API void Shutdown() noexcept;
+		/// <summary>
+		/// Shutdown()后最多等待timeout，返回线程是否都已退出。返回true后可以再次Start
+		/// <para>处理器迟迟不返回时返回false，线程仍在运行，析构时会一直等到它退出；在处理器中调用时不等待，返回false</para>
+		/// </summary>
+		DISPATCHER_API bool Stop(std::chrono::milliseconds timeout = std::chrono::seconds{ 5 }) noexcept;
 
 		DISPATCHER_API void operator() (void) noexcept;
 		DISPATCHER_API void ReadSafeThreadFunction(void) noexcept;
 
 		DISPATCHER_API void RegisterCallback(HandlerRecord& handler);
 		DISPATCHER_API void RegisterCallresult(HandlerRecord& handler);
+		DISPATCHER_API void RegisterCallresult(HandlerRecord& handler, std::chrono::milliseconds timeout);
+		DISPATCHER_API void RegisterCallresults(std::span<HandlerRecord* const> handlers);
 
 		DISPATCHER_API void UnRegisterCallResult(HandlerRecord* handler);
+		/// <summary>
+		/// 注销CreateCallresult创建的记录，返回是否注销成功；记录已经触发、超时或被注销时返回false
+		/// </summary>
+		DISPATCHER_API bool UnRegisterCallResult(const callresult_ticket& ticket);
+		/// <summary>
+		/// 注销回调处理器，等其他线程上正在调用它的处理器返回后才返回，返回后可以释放handler
+		/// <para>可以在处理器中注销自己或同一回调的其他处理器，本条消息不会再调用被注销的处理器</para>
+		/// </summary>
 		DISPATCHER_API void UnRegisterCallback(HandlerRecord* handler);
+		DISPATCHER_API void UnRegisterCallresults(std::span<HandlerRecord* const> handlers);
+
+		/// <summary>
+		/// 把调用结果的登记放入无锁队列后立即返回，不加锁，不会被正在运行的处理器阻塞。分发线程在下一轮开始时登记
+		/// <para>超时从登记生效时算起。记录不能已经登记；在Invoke或Release被调用前必须有效</para>
+		/// </summary>
+		DISPATCHER_API void PostCallresult(HandlerRecord& handler, std::chrono::milliseconds timeout = {}) noexcept;
+		/// <summary>
+		/// 撤销经PostCallresult登记的记录，不加锁，不等待
+		/// <para>返回true时记录不会再被调用，分发线程稍后调用Release；返回false表示记录已经或正在被调用</para>
+		/// <para>调用者只能从Release得知何时可以释放记录，LambdaHandler、TypedHandler等不重写Release的记录应改用PostCallresult&lt;T&gt;</para>
+		/// </summary>
+		DISPATCHER_API bool CancelCallresult(HandlerRecord& handler) noexcept;
+
+		/// <summary>
+		/// 由分发器创建记录，经登记队列登记，不加锁；handler(const T*, bool iofail)，触发、超时或撤销后记录自动回收
+		/// <para>返回的凭据交给UnRegisterCallResult撤销，此时先应用队列中已有的登记，所以不会漏掉尚未生效的记录</para>
+		/// <para>创建记录时分配失败会抛出异常，此时没有登记</para>
+		/// </summary>
+		template<classic_param T, typename F>
+			requires std::invocable<F&, const T*, bool>
+		callresult_ticket PostCallresult(SteamAPICall_t handle, F&& handler, std::chrono::milliseconds timeout = {})
+		{
+			auto* record = MakePooled<T>(handle, std::forward<F>(handler));
+			callresult_ticket ticket{ handle, record->callback_typeid, record, record->Serial() };
+			PostCallresult(*record, timeout);
+			return ticket;
+		}
+
+		/// <summary>
+		/// 等待调用结果，不能与ReadSafeThreadFunction一起使用
+		/// </summary>
+		template<classic_param T>
+		callresult_awaiter<T, mthread_dispatcher> result(SteamAPICall_t handle) { return { *this, handle }; }
+
+		/// <summary>
+		/// 由分发器创建并登记调用结果记录，handler(const T*, bool iofail)，触发、超时或注销后记录自动回收
+		/// <para>返回的凭据可以随时交给UnRegisterCallResult，记录已回收时什么都不做</para>
+		/// </summary>
+		template<classic_param T, typename F>
+			requires std::invocable<F&, const T*, bool>
+		callresult_ticket CreateCallresult(SteamAPICall_t handle, F&& handler, std::chrono::milliseconds timeout = {})
+		{
+			auto* record = MakePooled<T>(handle, std::forward<F>(handler));
+			callresult_ticket ticket{ handle, record->callback_typeid, record, record->Serial() };
+			try
+			{
+				RegisterCallresult(*record, timeout);
+			}
+			catch (...)
+			{
+				record->Release();
+				throw;
+			}
+			return ticket;
+		}
 		
-		DISPATCHER_API static void Initialize();
-		DISPATCHER_API static void StartThread(bool isReadSafe = false);
-		DISPATCHER_API static void Destory();
+		/// <summary>
+		/// 为某个callback_typeid单独指定线程池模式下的顺序，应在StartThread前设置
+		/// </summary>
+		DISPATCHER_API void SetDispatchOrder(int callback_typeid, dispatch_order order);
+
+		template<classic_param T>
+		void SetDispatchOrder(dispatch_order order) { SetDispatchOrder(T::k_iCallback, order); }
+
+		/// <summary>
+		/// 分发线程的亲和性、优先级、名字和栈大小，在下次启动时生效。流水线模式的两个线程使用相同的设置，第一阶段线程名加后缀"-in"
+		/// <para>线程池的工作线程不受影响。应用失败时Start抛出std::system_error，线程不会启动</para>
+		/// </summary>
+		DISPATCHER_API void SetThreadOptions(const thread_options& options);
+
+		DISPATCHER_API static void Initialize(steam_pipe pipe = steam_pipe::client);
+		DISPATCHER_API static void StartThread(bool isReadSafe = false, steam_pipe pipe = steam_pipe::client);
+		/// <summary>
+		/// 以线程池模式启动
+		/// </summary>
+		DISPATCHER_API static void StartThread(const pool_options& options, steam_pipe pipe = steam_pipe::client);
+		/// <summary>
+		/// 以两阶段流水线模式启动，见Start(const pipeline_options&amp;)
+		/// </summary>
+		DISPATCHER_API static void StartThread(const pipeline_options& options, steam_pipe pipe = steam_pipe::client);
+		DISPATCHER_API static void Destory(steam_pipe pipe = steam_pipe::client);
+
+		/// <summary>
+		/// 创建独立的实例，有自己的处理器表、参数缓冲区和线程，与Get()返回的单例互不影响
+		/// <para>同一管道只能有一个实例读取消息，其余实例应作为RouteUser的目标</para>
+		/// </summary>
+		DISPATCHER_API static std::unique_ptr<mthread_dispatcher> Create(steam_pipe pipe = steam_pipe::client);
+		/// <summary>
+		/// 启动本实例的分发线程，同StartThread
+		/// </summary>
+		DISPATCHER_API void Start(bool isReadSafe = false);
+		DISPATCHER_API void Start(const pool_options& options);
+		/// <summary>
+		/// 以两阶段流水线启动：第一阶段线程取出所有消息和调用结果，写入预分配的环形缓冲区后立即归还steam的消息；
+		/// 第二阶段线程从缓冲区分发，处理器再慢也不会拖住steam的队列
+		/// <para>缓冲区满时第一阶段等待，消息暂留在steam中。作为RouteUser的目标时没有管道可读，按Start(options.readsafe)启动</para>
+		/// </summary>
+		DISPATCHER_API void Start(const pipeline_options& options);
+		/// <summary>
+		/// 流水线模式下环形缓冲区的占用和溢出统计，其他模式下全为0
+		/// </summary>
+		DISPATCHER_API pipeline_stats PipelineStats() const;
+
+		/// <summary>
+		/// 把m_hSteamUser为user的消息转发给target，由target的线程用target的处理器分发
+		/// <para>target应在同一管道上，在target启动之前设置；target启动时有路由指向它，则这次运行只处理转发来的消息，不读取管道</para>
+		/// </summary>
+		DISPATCHER_API void RouteUser(int32 user, mthread_dispatcher& target);
+		/// <summary>
+		/// 撤销转发。返回后不会再有消息转发给原来的target，之后可以销毁target
+		/// <para>指向target的路由全部撤销后，target下次启动时恢复读取管道</para>
+		/// </summary>
+		DISPATCHER_API void UnRouteUser(int32 user);
 
 		/// <summary>
-		/// 获取单例，可以缓存返回值
+		/// 获取单例，可以缓存返回值。客户端和游戏服务器管道各有一个实例和分发线程
 		/// </summary>
-		DISPATCHER_API static mthread_dispatcher& Get();
+		DISPATCHER_API static mthread_dispatcher& Get(steam_pipe pipe = steam_pipe::client);
 	};
 }
 
@@ -0,0 +1,151 @@
+﻿#include "metrics.hpp"
+#include <map>
+#include <utility>
+
+namespace
+{
+	std::atomic<steam::uint64> next_generation = 1;
+}
+
+void steam::events::detail::metrics_registry::atomic_histogram::record(uint64 ns) noexcept
+{
+	buckets[latency_histogram::BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void steam::events::detail::metrics_registry::atomic_histogram::merge_into(latency_histogram& out) const noexcept
+{
+	for (std::size_t i = 0; i < latency_histogram::bucket_count; ++i)
+	{
+		auto n = buckets[i].load(std::memory_order_relaxed);
+		out.buckets[i] += n;
+		out.count += n;
+	}
+}
+
+steam::events::detail::metrics_registry::block::~block()
+{
+	for (auto& s : stats)
+		delete s.load(std::memory_order_relaxed);
+}
+
+steam::events::detail::metrics_registry::shard::~shard()
+{
+	for (auto& b : blocks)
+		delete b.load(std::memory_order_relaxed);
+}
+
+steam::events::detail::metrics_registry::callback_stats& steam::events::detail::metrics_registry::shard::at(int callback_typeid)
+{
+	if (callback_typeid < 0 || callback_typeid >= overflow_id)
+		callback_typeid = overflow_id;
+
+	auto& b = blocks[callback_typeid / block_size];
+	auto* pb = b.load(std::memory_order_relaxed);
+	if (!pb)
+	{
+		pb = new block();
+		b.store(pb, std::memory_order_release);
+	}
+
+	auto& s = pb->stats[callback_typeid % block_size];
+	auto* ps = s.load(std::memory_order_relaxed);
+	if (!ps)
+	{
+		ps = new callback_stats();
+		s.store(ps, std::memory_order_release);
+	}
+	return *ps;
+}
+
+steam::events::detail::metrics_registry::metrics_registry() : generation(next_generation++)
+{
+}
+
+steam::events::detail::metrics_registry::shard& steam::events::detail::metrics_registry::local()
+{
+	thread_local std::vector<std::pair<uint64, shard*>> cache;
+	for (auto& [gen, s] : cache)
+		if (gen == generation)
+			return *s;
+
+	auto owned = std::make_unique<shard>();
+	auto* s = owned.get();
+	{
+		std::lock_guard g{ lock };
+		shards.push_back(std::move(owned));
+	}
+	cache.emplace_back(generation, s);
+	return *s;
+}
+
+void steam::events::detail::metrics_registry::record_message(int callback_typeid) noexcept
+{
+	try
+	{
+		local().at(callback_typeid).messages.fetch_add(1, std::memory_order_relaxed);
+	}
+	catch (...)
+	{
+		// 统计数据丢失不影响分发
+	}
+}
+
+void steam::events::detail::metrics_registry::record_invoke(int callback_typeid, uint64 ns) noexcept
+{
+	try
+	{
+		local().at(callback_typeid).invoke.record(ns);
+	}
+	catch (...)
+	{
+	}
+}
+
+void steam::events::detail::metrics_registry::record_delay(int callback_typeid, uint64 ns) noexcept
+{
+	try
+	{
+		local().at(callback_typeid).delay.record(ns);
+	}
+	catch (...)
+	{
+	}
+}
+
+steam::events::metrics_snapshot steam::events::detail::metrics_registry::snapshot() const
+{
+	std::map<int, callback_metrics> merged;
+
+	std::lock_guard g{ lock };
+	for (auto& s : shards)
+	{
+		for (int b = 0; b < block_count; ++b)
+		{
+			auto* pb = s->blocks[b].load(std::memory_order_acquire);
+			if (!pb)
+				continue;
+
+			for (int i = 0; i < block_size; ++i)
+			{
+				auto* ps = pb->stats[i].load(std::memory_order_acquire);
+				if (!ps)
+					continue;
+
+				int id = b * block_size + i;
+				auto [iter, inserted] = merged.try_emplace(id);
+				auto& m = iter->second;
+				if (inserted)
+					m.callback_typeid = id;
+				m.messages += ps->messages.load(std::memory_order_relaxed);
+				ps->invoke.merge_into(m.invoke);
+				ps->delay.merge_into(m.delay);
+			}
+		}
+	}
+
+	metrics_snapshot result;
+	result.callbacks.reserve(merged.size());
+	for (auto& [id, m] : merged)
+		result.callbacks.push_back(m);
+	return result;
+}
@@ -0,0 +1,150 @@
+﻿#pragma once
+#include "types.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace steam::events
+{
+	/// <summary>
+	/// 对数-线性分桶的延迟直方图（纳秒），与HDR Histogram相同的思路：
+	/// 每个2的幂区间再均分为8个子桶，相对误差不超过12.5%，超过2^40ns的值计入最后一个桶
+	/// </summary>
+	struct latency_histogram
+	{
+		static constexpr std::size_t sub_buckets = 8u;
+		static constexpr int max_magnitude = 40;
+		static constexpr std::size_t bucket_count = (max_magnitude - 2) * sub_buckets;
+
+		std::array<uint64, bucket_count> buckets{};
+		uint64 count = 0;
+
+		static constexpr std::size_t BucketOf(uint64 ns) noexcept
+		{
+			if (ns < 2 * sub_buckets)
+				return static_cast<std::size_t>(ns);
+
+			int msb = 63 - std::countl_zero(ns);
+			if (msb >= max_magnitude)
+				return bucket_count - 1;
+			return static_cast<std::size_t>(msb - 2) * sub_buckets + ((ns >> (msb - 3)) & (sub_buckets - 1));
+		}
+
+		/// <summary>
+		/// 桶内最大值
+		/// </summary>
+		static constexpr uint64 UpperBound(std::size_t bucket) noexcept
+		{
+			if (bucket < 2 * sub_buckets)
+				return bucket;
+
+			int msb = static_cast<int>(bucket / sub_buckets) + 2;
+			uint64 lower = (sub_buckets + bucket % sub_buckets) << (msb - 3);
+			return lower + (uint64{ 1 } << (msb - 3)) - 1;
+		}
+
+		/// <summary>
+		/// q取[0, 1]，返回对应分位所在桶的上界，没有样本时返回0
+		/// </summary>
+		uint64 Percentile(double q) const noexcept
+		{
+			if (!count)
+				return 0;
+
+			auto rank = static_cast<uint64>(q * static_cast<double>(count - 1)) + 1;
+			uint64 seen = 0;
+			for (std::size_t i = 0; i < bucket_count; ++i)
+			{
+				seen += buckets[i];
+				if (seen >= rank)
+					return UpperBound(i);
+			}
+			return UpperBound(bucket_count - 1);
+		}
+	};
+
+	struct callback_metrics
+	{
+		int callback_typeid = 0;
+		// 收到的消息数，调用结果按其结果类型计数
+		uint64 messages = 0;
+		// 处理器执行耗时
+		latency_histogram invoke;
+		// 从取出消息到开始调用处理器的延迟
+		latency_histogram delay;
+	};
+
+	struct metrics_snapshot
+	{
+		// 按callback_typeid升序
+		std::vector<callback_metrics> callbacks;
+		// 登记了但尚未触发的调用结果
+		std::size_t outstanding_callresults = 0;
+	};
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 分发器的统计数据。每个写入线程有自己的分片，只有该线程写，使用relaxed原子操作，
+	/// 快照时合并所有分片
+	/// </summary>
+	class metrics_registry
+	{
+	private:
+		struct atomic_histogram
+		{
+			std::array<std::atomic<uint64>, latency_histogram::bucket_count> buckets{};
+
+			void record(uint64 ns) noexcept;
+			void merge_into(latency_histogram& out) const noexcept;
+		};
+
+		struct callback_stats
+		{
+			std::atomic<uint64> messages = 0;
+			atomic_histogram invoke;
+			atomic_histogram delay;
+		};
+
+		// k_iCallback / 100 选段，超出范围的id都计入overflow_id
+		static constexpr int block_size = 100;
+		static constexpr int block_count = 128;
+		static constexpr int overflow_id = block_size * block_count - 1;
+
+		struct block
+		{
+			std::array<std::atomic<callback_stats*>, block_size> stats{};
+			~block();
+		};
+
+		struct shard
+		{
+			std::array<std::atomic<block*>, block_count> blocks{};
+			~shard();
+
+			callback_stats& at(int callback_typeid);
+		};
+
+		// 用于线程局部缓存的键，避免新实例复用旧实例的地址
+		const uint64 generation;
+
+		mutable std::mutex lock;
+		std::vector<std::unique_ptr<shard>> shards;
+
+		shard& local();
+	public:
+		metrics_registry();
+		metrics_registry(const metrics_registry&) = delete;
+
+		void record_message(int callback_typeid) noexcept;
+		void record_invoke(int callback_typeid, uint64 ns) noexcept;
+		void record_delay(int callback_typeid, uint64 ns) noexcept;
+
+		metrics_snapshot snapshot() const;
+	};
+}
@@ -0,0 +1,115 @@
+﻿#include "os_thread.hpp"
+#include <stdexcept>
+
+void steam::events::detail::wake_signal::raise() noexcept
+{
+	{
+		std::lock_guard g{ lock };
+		++generation;
+	}
+	cv.notify_all();
+}
+
+steam::uint64 steam::events::detail::wake_signal::current() noexcept
+{
+	std::lock_guard g{ lock };
+	return generation;
+}
+
+bool steam::events::detail::wake_signal::wait_for(std::chrono::microseconds timeout, uint64& seen)
+{
+	std::unique_lock g{ lock };
+	bool woken = cv.wait_for(g, timeout, [&] { return generation != seen; });
+	seen = generation;
+	return woken;
+}
+
+steam::events::detail::os_thread::~os_thread()
+{
+	join();
+}
+
+void steam::events::detail::os_thread::start(const thread_options& opt, std::function<void()> f)
+{
+	if (running)
+		throw std::runtime_error("thread is already running");
+
+	options = opt;
+	body = std::move(f);
+	configured = false;
+	done = false;
+	error = nullptr;
+	create();
+	running = true;
+
+	std::exception_ptr failure;
+	{
+		std::unique_lock g{ lock };
+		changed.wait(g, [this] { return configured; });
+		failure = error;
+	}
+	if (failure)
+	{
+		wait();
+		running = false;
+		std::rethrow_exception(failure);
+	}
+}
+
+bool steam::events::detail::os_thread::join_for(std::chrono::milliseconds timeout) noexcept
+{
+	if (!running)
+		return true;
+	if (is_current())
+		return false;
+
+	{
+		std::unique_lock g{ lock };
+		if (!changed.wait_for(g, timeout, [this] { return done; }))
+			return false;
+	}
+	wait();
+	running = false;
+	return true;
+}
+
+void steam::events::detail::os_thread::join() noexcept
+{
+	if (!running)
+		return;
+	if (is_current())
+		detach();
+	else
+		wait();
+	running = false;
+}
+
+void steam::events::detail::os_thread::run(void* self) noexcept
+{
+	auto* thread = static_cast<os_thread*>(self);
+	thread->id = std::this_thread::get_id();
+
+	std::exception_ptr failure;
+	try
+	{
+		thread->configure();
+	}
+	catch (...)
+	{
+		failure = std::current_exception();
+	}
+	{
+		std::lock_guard g{ thread->lock };
+		thread->error = failure;
+		thread->configured = true;
+	}
+	thread->changed.notify_all();
+
+	if (!failure)
+		thread->body();
+
+	// 之后只剩线程退出，join()等待的是真正的退出
+	std::lock_guard g{ thread->lock };
+	thread->done = true;
+	thread->changed.notify_all();
+}
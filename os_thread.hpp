@@ -0,0 +1,119 @@
+﻿#pragma once
+#include "types.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace steam::events
+{
+	/// <summary>
+	/// 分发线程的调度优先级，与win32的THREAD_PRIORITY_*对应
+	/// <para>posix下normal以外映射为线程的nice值（-10到10），time_critical使用SCHED_FIFO，提高优先级通常需要权限</para>
+	/// </summary>
+	enum class thread_priority
+	{
+		lowest,
+		below_normal,
+		// 不修改
+		normal,
+		above_normal,
+		highest,
+		time_critical,
+	};
+
+	struct thread_options
+	{
+		// CPU亲和性掩码，第i位表示可以运行在第i个逻辑处理器上，0表示不修改
+		uint64 affinity = 0;
+		thread_priority priority = thread_priority::normal;
+		// 线程名，显示在调试器和性能工具中，为空时不设置。posix下最多保留15字节
+		std::string name;
+		// 栈大小（字节），0表示平台默认
+		std::size_t stack_size = 0;
+	};
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 打断空闲睡眠的唤醒信号，每次raise()唤醒所有等待者。各等待者记住自己见过的代数，
+	/// 在两次等待之间发生的raise()不会丢失
+	/// </summary>
+	class wake_signal
+	{
+	private:
+		std::mutex lock;
+		std::condition_variable cv;
+		uint64 generation = 0;
+	public:
+		void raise() noexcept;
+		uint64 current() noexcept;
+		/// <summary>
+		/// 睡眠到代数不再是seen或超时，返回是否被唤醒，seen更新为当前代数
+		/// </summary>
+		bool wait_for(std::chrono::microseconds timeout, uint64& seen);
+	};
+
+	/// <summary>
+	/// 按thread_options创建的可等待线程。线程开始时先应用配置，失败时不执行body，start()抛出该异常
+	/// </summary>
+	class os_thread
+	{
+	private:
+		// win32为HANDLE，posix为pthread_t
+		std::uintptr_t handle = 0;
+		bool running = false;
+
+		thread_options options;
+		std::function<void()> body;
+		std::thread::id id;
+
+		std::mutex lock;
+		std::condition_variable changed;
+		// lock保护
+		bool configured = false;
+		bool done = false;
+		std::exception_ptr error;
+
+		// win32-threadimpl.cpp和posix-threadimpl.cpp实现
+		// 以options.stack_size创建执行run(this)的线程，失败时抛出std::system_error
+		void create();
+		// 等待线程退出并释放句柄
+		void wait() noexcept;
+		// 放弃等待，线程退出时自行释放
+		void detach() noexcept;
+		// 在当前线程上应用options，失败时抛出std::system_error；线程名只尽力设置
+		void configure() const;
+	public:
+		os_thread() = default;
+		os_thread(const os_thread&) = delete;
+		/// <summary>
+		/// 线程仍在运行时等待其退出
+		/// </summary>
+		~os_thread();
+
+		/// <summary>
+		/// 创建线程，等它应用完配置后返回。body不应抛出异常
+		/// </summary>
+		void start(const thread_options& options, std::function<void()> body);
+		/// <summary>
+		/// 最多等待timeout，线程已退出时回收并返回true。在该线程内调用时返回false
+		/// </summary>
+		bool join_for(std::chrono::milliseconds timeout) noexcept;
+		/// <summary>
+		/// 等待线程退出。在该线程内调用时不等待，线程退出时自行释放
+		/// </summary>
+		void join() noexcept;
+		bool joinable() const noexcept { return running; }
+		bool is_current() const noexcept { return running && id == std::this_thread::get_id(); }
+
+		// 平台线程的入口
+		static void run(void* self) noexcept;
+	};
+}
@@ -0,0 +1,81 @@
+﻿#include "param_pool.hpp"
+#include <new>
+
+namespace
+{
+	constexpr std::size_t align_up(std::size_t n) noexcept
+	{
+		constexpr std::size_t a = alignof(std::max_align_t);
+		return (n + a - 1) / a * a;
+	}
+}
+
+steam::events::detail::param_pool::param_pool(std::size_t count, uint32 capacity) : capacity(capacity)
+{
+	// 每块按max_align_t对齐，参数紧跟在头部之后，至少8字节对齐
+	static_assert(sizeof(param_buffer) % 8 == 0);
+	const std::size_t stride = align_up(sizeof(param_buffer) + capacity);
+	memory = ::operator new(stride * count, std::align_val_t{ alignof(std::max_align_t) });
+
+	auto* bytes = static_cast<uint8*>(memory);
+	for (std::size_t i = count; i-- > 0;)
+	{
+		auto* buffer = reinterpret_cast<param_buffer*>(bytes + i * stride);
+		buffer->owner = this;
+		buffer->next = idle;
+		buffer->refs.store(0, std::memory_order_relaxed);
+		buffer->size = 0;
+		idle = buffer;
+	}
+}
+
+steam::events::detail::param_pool::~param_pool()
+{
+	::operator delete(memory, std::align_val_t{ alignof(std::max_align_t) });
+}
+
+void steam::events::detail::param_pool::unref() noexcept
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete this;
+}
+
+steam::events::detail::param_buffer* steam::events::detail::param_pool::acquire(uint32 size) noexcept
+{
+	if (size > capacity)
+		return nullptr;
+
+	param_buffer* buffer;
+	{
+		std::lock_guard g{ lock };
+		buffer = idle;
+		if (!buffer)
+			return nullptr;
+		idle = buffer->next;
+	}
+
+	refs.fetch_add(1, std::memory_order_relaxed);
+	buffer->next = nullptr;
+	buffer->size = size;
+	buffer->refs.store(1, std::memory_order_relaxed);
+	return buffer;
+}
+
+void steam::events::detail::param_pool::add_ref(param_buffer* buffer) noexcept
+{
+	buffer->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void steam::events::detail::param_pool::release(param_buffer* buffer) noexcept
+{
+	if (buffer->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	auto* pool = buffer->owner;
+	{
+		std::lock_guard g{ pool->lock };
+		buffer->next = pool->idle;
+		pool->idle = buffer;
+	}
+	pool->unref();
+}
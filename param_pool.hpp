@@ -0,0 +1,109 @@
+﻿#pragma once
+#include "dispatcher_api.hpp"
+#include "types.hpp"
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+namespace steam::events::detail
+{
+	class param_pool;
+
+	/// <summary>
+	/// 池中的一块参数缓冲区，头部之后是capacity字节数据
+	/// </summary>
+	struct param_buffer
+	{
+		param_pool* owner;
+		param_buffer* next; // 空闲链表
+		std::atomic<uint32> refs;
+		uint32 size;
+
+		uint8* data() noexcept { return reinterpret_cast<uint8*>(this + 1); }
+	};
+
+	/// <summary>
+	/// 固定数量、固定容量的引用计数参数缓冲区，用完即止，不再分配
+	/// <para>池本身也有引用计数：分发器持有一份，每块借出的缓冲区一份，所以租约可以比分发器活得久</para>
+	/// </summary>
+	class param_pool
+	{
+	private:
+		const uint32 capacity;
+		std::mutex lock;
+		param_buffer* idle = nullptr;
+		std::atomic<std::size_t> refs = 1;
+		void* memory = nullptr;
+
+		~param_pool();
+		void unref() noexcept;
+	public:
+		param_pool(std::size_t count, uint32 capacity);
+		param_pool(const param_pool&) = delete;
+
+		uint32 buffer_capacity() const noexcept { return capacity; }
+
+		/// <summary>
+		/// 借出一块缓冲区，引用计数为1；size超过容量或池已耗尽时返回nullptr
+		/// </summary>
+		param_buffer* acquire(uint32 size) noexcept;
+
+		DISPATCHER_API static void add_ref(param_buffer* buffer) noexcept;
+		/// <summary>
+		/// 引用计数归零时还给池
+		/// </summary>
+		DISPATCHER_API static void release(param_buffer* buffer) noexcept;
+
+		/// <summary>
+		/// 分发器放弃自己的那份引用，最后一块缓冲区归还后池被删除
+		/// </summary>
+		void close() noexcept { unref(); }
+
+		struct closer
+		{
+			void operator()(param_pool* pool) const noexcept { pool->close(); }
+		};
+	};
+}
+
+namespace steam::events
+{
+	/// <summary>
+	/// 参数缓冲区的租约，复制只增加引用计数，最后一份租约析构时缓冲区还给池
+	/// <para>可以交给其他线程，不需要复制参数</para>
+	/// </summary>
+	class param_lease
+	{
+	private:
+		detail::param_buffer* buffer = nullptr;
+	public:
+		param_lease() noexcept = default;
+		// 接管一份引用
+		explicit param_lease(detail::param_buffer* buffer) noexcept : buffer(buffer) {}
+		param_lease(const param_lease& other) noexcept : buffer(other.buffer)
+		{
+			if (buffer)
+				detail::param_pool::add_ref(buffer);
+		}
+		param_lease(param_lease&& other) noexcept : buffer(std::exchange(other.buffer, nullptr)) {}
+		param_lease& operator=(param_lease other) noexcept
+		{
+			std::swap(buffer, other.buffer);
+			return *this;
+		}
+		~param_lease()
+		{
+			if (buffer)
+				detail::param_pool::release(buffer);
+		}
+
+		explicit operator bool() const noexcept { return buffer != nullptr; }
+
+		const uint8* data() const noexcept { return buffer ? buffer->data() : nullptr; }
+		uint32 size() const noexcept { return buffer ? buffer->size : 0; }
+
+		template<typename T>
+		const T* as() const noexcept { return reinterpret_cast<const T*>(data()); }
+	};
+}
@@ -0,0 +1,36 @@
+﻿#include "events.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <new>
+
+void steam::events::sthread_dispatcher::AllocBuff()
+{
+	void* p = MAP_FAILED;
+
+#if defined(STWKS20_EVENTS_HUGEPAGES) && defined(MAP_HUGETLB)
+	// 需要预留大页（vm.nr_hugepages），失败时退回普通分页
+	constexpr uint32_t hugepage = 2u * 1024u * 1024u;
+	if (buffsize % hugepage == 0)
+		p = ::mmap(nullptr, buffsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+	if (p == MAP_FAILED)
+		p = ::mmap(nullptr, buffsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		throw std::bad_alloc();
+
+#if defined(STWKS20_EVENTS_HUGEPAGES) && defined(MADV_HUGEPAGE)
+	::madvise(p, buffsize, MADV_HUGEPAGE);
+#endif
+
+	parambuff = static_cast<unsigned char*>(p);
+}
+
+void steam::events::sthread_dispatcher::FreeBuff()
+{
+	if (parambuff)
+		::munmap(parambuff, buffsize);
+}
+#endif
@@ -0,0 +1,50 @@
+﻿#include "capture.hpp"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void steam::events::detail::capture_log::open_file(const std::filesystem::path& path)
+{
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open");
+	file = fd;
+}
+
+void steam::events::detail::capture_log::map(uint64 size)
+{
+	int fd = static_cast<int>(file);
+	if (::ftruncate(fd, static_cast<off_t>(size)) != 0)
+		throw std::system_error(errno, std::generic_category(), "ftruncate");
+
+	void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category(), "mmap");
+
+	view = static_cast<uint8*>(p);
+	capacity = size;
+}
+
+void steam::events::detail::capture_log::unmap() noexcept
+{
+	if (view)
+		::munmap(view, capacity);
+	view = nullptr;
+	capacity = 0;
+}
+
+void steam::events::detail::capture_log::close_file() noexcept
+{
+	if (file < 0)
+		return;
+
+	// 截掉映射时预留的空间
+	(void)::ftruncate(static_cast<int>(file), static_cast<off_t>(used));
+	::close(static_cast<int>(file));
+	file = -1;
+}
+#endif
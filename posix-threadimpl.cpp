@@ -0,0 +1,135 @@
+﻿#include "os_thread.hpp"
+
+#ifndef _WIN32
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <pthread.h>
+#include <sched.h>
+#include <climits>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(pthread_t) <= sizeof(std::uintptr_t));
+
+namespace
+{
+	void* thread_entry(void* self)
+	{
+		steam::events::detail::os_thread::run(self);
+		return nullptr;
+	}
+
+	pthread_t as_pthread(std::uintptr_t handle) noexcept
+	{
+		pthread_t thread{};
+		std::memcpy(&thread, &handle, sizeof(thread));
+		return thread;
+	}
+
+	// lowest到highest对应的nice值
+	int nice_of(steam::events::thread_priority priority) noexcept
+	{
+		switch (priority)
+		{
+		case steam::events::thread_priority::lowest: return 10;
+		case steam::events::thread_priority::below_normal: return 5;
+		case steam::events::thread_priority::above_normal: return -5;
+		case steam::events::thread_priority::highest: return -10;
+		default: return 0;
+		}
+	}
+}
+
+void steam::events::detail::os_thread::create()
+{
+	pthread_attr_t attr;
+	int rc = ::pthread_attr_init(&attr);
+	if (rc != 0)
+		throw std::system_error(rc, std::generic_category(), "pthread_attr_init");
+
+	if (options.stack_size)
+		rc = ::pthread_attr_setstacksize(&attr, std::max<std::size_t>(options.stack_size, PTHREAD_STACK_MIN));
+
+	pthread_t thread{};
+	if (rc == 0)
+		rc = ::pthread_create(&thread, &attr, thread_entry, this);
+	::pthread_attr_destroy(&attr);
+	if (rc != 0)
+		throw std::system_error(rc, std::generic_category(), "pthread_create");
+
+	handle = 0;
+	std::memcpy(&handle, &thread, sizeof(thread));
+}
+
+void steam::events::detail::os_thread::wait() noexcept
+{
+	::pthread_join(as_pthread(handle), nullptr);
+	handle = 0;
+}
+
+void steam::events::detail::os_thread::detach() noexcept
+{
+	::pthread_detach(as_pthread(handle));
+	handle = 0;
+}
+
+void steam::events::detail::os_thread::configure() const
+{
+	pthread_t self = ::pthread_self();
+	if (options.affinity)
+	{
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu)
+			if (options.affinity & (uint64{ 1 } << cpu))
+				CPU_SET(cpu, &set);
+		if (int rc = ::pthread_setaffinity_np(self, sizeof(set), &set); rc != 0)
+			throw std::system_error(rc, std::generic_category(), "pthread_setaffinity_np");
+#else
+		throw std::system_error(ENOTSUP, std::generic_category(), "thread affinity");
+#endif
+	}
+
+	if (options.priority == thread_priority::time_critical)
+	{
+		sched_param param{};
+		param.sched_priority = ::sched_get_priority_min(SCHED_FIFO);
+		if (int rc = ::pthread_setschedparam(self, SCHED_FIFO, &param); rc != 0)
+			throw std::system_error(rc, std::generic_category(), "pthread_setschedparam");
+	}
+	else if (options.priority != thread_priority::normal)
+	{
+#ifdef __linux__
+		// linux的nice值按线程生效
+		auto tid = static_cast<id_t>(::syscall(SYS_gettid));
+		if (::setpriority(PRIO_PROCESS, tid, nice_of(options.priority)) != 0)
+			throw std::system_error(errno, std::generic_category(), "setpriority");
+#else
+		// 在SCHED_OTHER的优先级范围内按nice值反向插值
+		int policy = SCHED_OTHER;
+		sched_param param{};
+		::pthread_getschedparam(self, &policy, &param);
+		int low = ::sched_get_priority_min(policy), high = ::sched_get_priority_max(policy);
+		param.sched_priority = low + (high - low) * (10 - nice_of(options.priority)) / 20;
+		if (int rc = ::pthread_setschedparam(self, policy, &param); rc != 0)
+			throw std::system_error(rc, std::generic_category(), "pthread_setschedparam");
+#endif
+	}
+
+	if (!options.name.empty())
+	{
+		std::string name = options.name.substr(0, 15);
+#ifdef __APPLE__
+		::pthread_setname_np(name.c_str());
+#else
+		::pthread_setname_np(self, name.c_str());
+#endif
+	}
+}
+#endif
@@ -0,0 +1,47 @@
+﻿#include "post_queue.hpp"
+
+steam::events::detail::post_queue::post_queue() noexcept : head(&stub), tail(&stub)
+{
+}
+
+void steam::events::detail::post_queue::push(post_hook* hook) noexcept
+{
+	hook->next.store(nullptr, std::memory_order_relaxed);
+	auto* prev = head.exchange(hook, std::memory_order_acq_rel);
+	// 此时消费者看不到hook，直到下面这次写入
+	prev->next.store(hook, std::memory_order_release);
+}
+
+steam::events::detail::post_hook* steam::events::detail::post_queue::pop() noexcept
+{
+	auto* first = tail.load(std::memory_order_relaxed);
+	auto* next = first->next.load(std::memory_order_acquire);
+	if (first == &stub)
+	{
+		if (!next)
+			return nullptr;
+		first = next;
+		tail.store(first, std::memory_order_relaxed);
+		next = next->next.load(std::memory_order_acquire);
+	}
+
+	if (next)
+	{
+		tail.store(next, std::memory_order_relaxed);
+		return first;
+	}
+
+	// first之后还有生产者没写完next，下次再取
+	if (first != head.load(std::memory_order_acquire))
+		return nullptr;
+
+	// first是最后一个节点，放回stub后才能把它取走
+	push(&stub);
+	next = first->next.load(std::memory_order_acquire);
+	if (next)
+	{
+		tail.store(next, std::memory_order_relaxed);
+		return first;
+	}
+	return nullptr;
+}
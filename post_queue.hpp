@@ -0,0 +1,58 @@
+﻿#pragma once
+#include "types.hpp"
+#include <atomic>
+
+namespace steam::events
+{
+	class HandlerRecord;
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 嵌在HandlerRecord中的登记队列节点，由post_queue管理
+	/// <para>state只对经登记队列登记的记录有意义，直接登记的记录始终为idle</para>
+	/// </summary>
+	struct post_hook
+	{
+		enum : uint8 { idle, queued, armed, cancelled, fired };
+
+		std::atomic<post_hook*> next = nullptr;
+		HandlerRecord* owner = nullptr;
+		std::atomic<uint8> state = idle;
+		// 登记时指定的超时，毫秒，0表示不超时
+		uint32 timeout = 0;
+
+		/// <summary>
+		/// 分发线程取出记录准备调用时与撤销竞争，返回false表示已被撤销，记录留给登记队列回收
+		/// </summary>
+		bool claim() noexcept
+		{
+			uint8 expected = state.load(std::memory_order_acquire);
+			if (expected == armed && state.compare_exchange_strong(expected, fired, std::memory_order_acq_rel))
+				return true;
+			return expected != cancelled;
+		}
+	};
+
+	/// <summary>
+	/// 侵入式无锁多生产者单消费者队列，push只有一次原子交换，不会等待
+	/// <para>pop同一时间只能有一个消费者调用，换线程消费时由调用者加锁；某个生产者push到一半时pop返回nullptr，剩下的节点下次再取</para>
+	/// </summary>
+	class post_queue
+	{
+	private:
+		std::atomic<post_hook*> head;
+		// 只有消费者修改，原子的只是为了让empty()可以不加锁判断
+		std::atomic<post_hook*> tail;
+		post_hook stub;
+	public:
+		post_queue() noexcept;
+		post_queue(const post_queue&) = delete;
+
+		void push(post_hook* hook) noexcept;
+		post_hook* pop() noexcept;
+		// 任何线程都可以调用，结果只作提示；有生产者push到一半时也不为空
+		bool empty() const noexcept { return tail.load(std::memory_order_relaxed) == &stub && head.load(std::memory_order_acquire) == &stub; }
+	};
+}
@@ -0,0 +1,61 @@
+﻿#include "record_slab.hpp"
+#include <new>
+
+std::size_t steam::events::detail::record_slab::class_of(std::size_t size) noexcept
+{
+	std::size_t cls = 0;
+	while (block_size(cls) < size)
+		++cls;
+	return cls;
+}
+
+steam::events::detail::record_slab::~record_slab()
+{
+	for (auto& c : classes)
+		for (void* chunk : c.chunks)
+			::operator delete(chunk, std::align_val_t{ block_align });
+}
+
+void* steam::events::detail::record_slab::allocate(std::size_t size)
+{
+	if (size > max_size)
+		return ::operator new(size);
+
+	auto cls = class_of(size);
+	auto& c = classes[cls];
+	std::lock_guard g{ c.lock };
+	if (!c.free)
+	{
+		c.chunks.reserve(c.chunks.size() + 1);
+		auto* chunk = static_cast<unsigned char*>(::operator new(chunk_size, std::align_val_t{ block_align }));
+		c.chunks.push_back(chunk);
+
+		// 逆序挂链，分配时按地址递增
+		auto bsize = block_size(cls);
+		for (std::size_t offset = chunk_size; offset >= bsize; offset -= bsize)
+		{
+			auto* block = reinterpret_cast<free_block*>(chunk + offset - bsize);
+			block->next = c.free;
+			c.free = block;
+		}
+	}
+
+	auto* block = c.free;
+	c.free = block->next;
+	return block;
+}
+
+void steam::events::detail::record_slab::deallocate(void* block, std::size_t size) noexcept
+{
+	if (size > max_size)
+	{
+		::operator delete(block);
+		return;
+	}
+
+	auto& c = classes[class_of(size)];
+	std::lock_guard g{ c.lock };
+	auto* b = static_cast<free_block*>(block);
+	b->next = c.free;
+	c.free = b;
+}
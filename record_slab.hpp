@@ -0,0 +1,47 @@
+﻿#pragma once
+#include "dispatcher_api.hpp"
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 按64/128/256/512字节分级的定长块分配器，块从64K的大块中切出，释放后挂回空闲链表复用
+	/// <para>大于max_size或对齐要求高于block_align的请求直接交给operator new</para>
+	/// </summary>
+	class record_slab
+	{
+	public:
+		static constexpr std::size_t block_align = 64u;
+		static constexpr std::size_t max_size = 512u;
+	private:
+		static constexpr std::size_t class_count = 4u;
+		static constexpr std::size_t chunk_size = 64u * 1024u;
+
+		struct free_block
+		{
+			free_block* next;
+		};
+
+		struct size_class
+		{
+			std::mutex lock;
+			free_block* free = nullptr;
+			std::vector<void*> chunks;
+		};
+
+		size_class classes[class_count];
+
+		static std::size_t class_of(std::size_t size) noexcept;
+		static constexpr std::size_t block_size(std::size_t cls) noexcept { return std::size_t{ 64u } << cls; }
+	public:
+		record_slab() = default;
+		record_slab(const record_slab&) = delete;
+		~record_slab();
+
+		// PooledHandler和MakePooled在调用方内联，需要导出
+		DISPATCHER_API void* allocate(std::size_t size);
+		DISPATCHER_API void deallocate(void* block, std::size_t size) noexcept;
+	};
+}
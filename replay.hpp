@@ -0,0 +1,61 @@
+﻿#pragma once
+#include "events.hpp"
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+namespace steam::events
+{
+	enum class replay_speed
+	{
+		// 按捕获时的间隔投递
+		recorded,
+		// 不等待，尽快投递
+		maximum
+	};
+
+	/// <summary>
+	/// 读取StartCapture写出的文件，把消息按原顺序重新投递给分发器。
+	/// <para>调用结果直接交给处理器，不经过steam，因此回放前需要登记与捕获时相同句柄的处理器</para>
+	/// </summary>
+	class replay_log
+	{
+	private:
+		struct message
+		{
+			detail::capture_record record;
+			const uint8* payload;
+		};
+
+		std::vector<uint8> data;
+		std::vector<message> messages;
+	public:
+		/// <summary>
+		/// 读入整个文件，格式错误时抛出std::runtime_error
+		/// </summary>
+		DISPATCHER_API explicit replay_log(const std::filesystem::path& path);
+
+		std::size_t size() const noexcept { return messages.size(); }
+
+		/// <summary>
+		/// 在当前线程投递所有消息，返回投递的条数
+		/// <para>mthread_dispatcher不能同时运行分发线程</para>
+		/// </summary>
+		template<typename Dispatcher>
+		std::size_t Replay(Dispatcher& dispatcher, replay_speed speed = replay_speed::recorded) const
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (const auto& [record, payload] : messages)
+			{
+				if (speed == replay_speed::recorded)
+					std::this_thread::sleep_until(start + std::chrono::nanoseconds{ record.timestamp });
+
+				if (record.kind == detail::capture_record::callresult)
+					dispatcher.InjectCallresult(record.handle, record.callback_typeid, payload, record.iofail != 0, record.size);
+				else
+					dispatcher.InjectCallback(record.callback_typeid, payload, record.size);
+			}
+			return messages.size();
+		}
+	};
+}
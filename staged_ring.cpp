@@ -0,0 +1,125 @@
+﻿#include "staged_ring.hpp"
+#include <algorithm>
+#include <bit>
+#include <new>
+
+namespace
+{
+	constexpr std::size_t unit = sizeof(steam::events::detail::staged_record);
+}
+
+steam::events::detail::staged_ring::staged_ring(std::size_t capacity)
+	: memory(nullptr), capacity(std::bit_ceil(std::max(capacity, unit * 64)))
+{
+	memory = static_cast<uint8*>(::operator new(this->capacity, std::align_val_t{ unit }));
+}
+
+steam::events::detail::staged_ring::~staged_ring()
+{
+	while (front())
+		pop();
+	::operator delete(memory, std::align_val_t{ unit });
+}
+
+steam::events::detail::staged_record* steam::events::detail::staged_ring::reserve(uint32 size)
+{
+	// 单条记录不超过容量一半，加上填充也放得进空的缓冲区
+	const bool indirect = size > capacity / 2 - unit;
+	const std::size_t stored = indirect ? sizeof(uint8*) : size;
+	const std::size_t span = unit + (stored + unit - 1) / unit * unit;
+
+	auto position = head.load(std::memory_order_relaxed);
+	auto offset = position & (capacity - 1);
+	// 尾部放不下时整段填充，从开头写
+	std::size_t padding = capacity - offset < span ? capacity - offset : 0;
+
+	if (position + padding + span - cached_tail > capacity)
+	{
+		cached_tail = tail.load(std::memory_order_acquire);
+		if (position + padding + span - cached_tail > capacity)
+			return nullptr;
+	}
+
+	uint8* payload = nullptr;
+	if (indirect)
+		payload = new uint8[size];
+
+	if (padding)
+	{
+		auto* pad = reinterpret_cast<staged_record*>(memory + offset);
+		pad->kind = staged_record::padding;
+		pad->span = static_cast<uint32>(padding);
+		offset = 0;
+	}
+
+	auto* record = reinterpret_cast<staged_record*>(memory + offset);
+	record->size = size;
+	record->span = static_cast<uint32>(span);
+	record->storage = indirect ? staged_record::indirect_payload : staged_record::inline_payload;
+	if (indirect)
+	{
+		*reinterpret_cast<uint8**>(record + 1) = payload;
+		oversized.fetch_add(1, std::memory_order_relaxed);
+	}
+	reserved_span = padding + span;
+	return record;
+}
+
+void steam::events::detail::staged_ring::commit() noexcept
+{
+	auto position = head.load(std::memory_order_relaxed) + reserved_span;
+	head.store(position, std::memory_order_release);
+	messages.fetch_add(1, std::memory_order_relaxed);
+
+	auto used = position - tail.load(std::memory_order_relaxed);
+	if (used > high_water.load(std::memory_order_relaxed))
+		high_water.store(used, std::memory_order_relaxed);
+}
+
+steam::events::detail::staged_record* steam::events::detail::staged_ring::front() noexcept
+{
+	auto position = tail.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if (position == cached_head)
+		{
+			cached_head = head.load(std::memory_order_acquire);
+			if (position == cached_head)
+				return nullptr;
+		}
+
+		auto* record = reinterpret_cast<staged_record*>(memory + (position & (capacity - 1)));
+		if (record->kind != staged_record::padding)
+			return record;
+
+		// 跳过填充
+		position += record->span;
+		tail.store(position, std::memory_order_release);
+	}
+}
+
+void steam::events::detail::staged_ring::pop() noexcept
+{
+	auto position = tail.load(std::memory_order_relaxed);
+	auto* record = reinterpret_cast<staged_record*>(memory + (position & (capacity - 1)));
+	if (record->storage == staged_record::indirect_payload)
+		delete[] record->data();
+	tail.store(position + record->span, std::memory_order_release);
+	popped.fetch_add(1, std::memory_order_relaxed);
+}
+
+steam::events::pipeline_stats steam::events::detail::staged_ring::stats() const noexcept
+{
+	pipeline_stats result;
+	result.capacity = capacity;
+	auto consumed = tail.load(std::memory_order_acquire);
+	auto produced = head.load(std::memory_order_acquire);
+	result.occupancy = produced > consumed ? produced - consumed : 0;
+	result.high_water = high_water.load(std::memory_order_relaxed);
+	auto done = popped.load(std::memory_order_acquire);
+	result.messages = messages.load(std::memory_order_acquire);
+	result.pending = result.messages > done ? static_cast<std::size_t>(result.messages - done) : 0;
+	result.overflows = overflows.load(std::memory_order_relaxed);
+	result.oversized = oversized.load(std::memory_order_relaxed);
+	return result;
+}
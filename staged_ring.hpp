@@ -0,0 +1,105 @@
+﻿#pragma once
+#include "types.hpp"
+#include <atomic>
+#include <cstddef>
+
+namespace steam::events
+{
+	struct pipeline_options
+	{
+		// 环形缓冲区的字节数，向上取整到2的幂
+		std::size_t capacity = std::size_t{ 1 } << 20;
+		// 第二阶段按ReadSafeThreadFunction的方式调用调用结果处理器
+		bool readsafe = false;
+	};
+
+	struct pipeline_stats
+	{
+		std::size_t capacity = 0;
+		// 尚未分发的字节数和消息数
+		std::size_t occupancy = 0;
+		std::size_t pending = 0;
+		std::size_t high_water = 0;
+		// 经过环形缓冲区的消息数
+		uint64 messages = 0;
+		// 缓冲区满、第一阶段不得不等待的次数，此时消息暂留在steam中
+		uint64 overflows = 0;
+		// 放不进容量一半、另行分配的参数
+		uint64 oversized = 0;
+	};
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 环形缓冲区中一条消息的头部，参数紧跟其后；每条记录占整数个头部大小
+	/// </summary>
+	struct staged_record
+	{
+		enum : uint8 { padding, callback, callresult };
+		enum : uint8 { inline_payload = 0, indirect_payload = 1 };
+
+		SteamAPICall_t handle;
+		// steady_clock的计数，取消息的时刻
+		int64 fetched;
+		int callback_typeid;
+		uint32 size;
+		// 整条记录的字节数
+		uint32 span;
+		uint8 kind;
+		uint8 iofail;
+		uint8 storage;
+		uint8 reserved;
+
+		uint8* data() noexcept
+		{
+			auto* inline_data = reinterpret_cast<uint8*>(this + 1);
+			if (storage == indirect_payload)
+				return *reinterpret_cast<uint8**>(inline_data);
+			return inline_data;
+		}
+	};
+	static_assert(sizeof(staged_record) == 32);
+
+	/// <summary>
+	/// 单生产者单消费者的变长记录环形缓冲区，参数连续存放，放不下尾部时用填充记录绕回开头
+	/// <para>生产者：reserve后写入，commit发布；消费者：front读取，pop释放</para>
+	/// </summary>
+	class staged_ring
+	{
+	private:
+		uint8* memory;
+		const std::size_t capacity;
+
+		// 生产者写、消费者读
+		alignas(64) std::atomic<std::size_t> head = 0;
+		std::size_t reserved_span = 0;
+		std::size_t cached_tail = 0;
+		// 消费者写、生产者读
+		alignas(64) std::atomic<std::size_t> tail = 0;
+		std::size_t cached_head = 0;
+
+		alignas(64) std::atomic<std::size_t> high_water = 0;
+		std::atomic<uint64> messages = 0;
+		std::atomic<uint64> popped = 0;
+		std::atomic<uint64> overflows = 0;
+		std::atomic<uint64> oversized = 0;
+	public:
+		explicit staged_ring(std::size_t capacity);
+		staged_ring(const staged_ring&) = delete;
+		~staged_ring();
+
+		/// <summary>
+		/// 为一条size字节参数的消息预留记录，空间不足时返回nullptr，成功后必须commit。放不进容量一半的参数另行分配
+		/// </summary>
+		staged_record* reserve(uint32 size);
+		void commit() noexcept;
+		// 生产者等待空间时调用
+		void note_overflow() noexcept { overflows.fetch_add(1, std::memory_order_relaxed); }
+
+		staged_record* front() noexcept;
+		void pop() noexcept;
+
+		pipeline_stats stats() const noexcept;
+	};
+}
@@ -0,0 +1,60 @@
+﻿#pragma once
+#include "events.hpp"
+#include <algorithm>
+#include <array>
+
+namespace steam::events
+{
+	/// <summary>
+	/// 编译期确定的回调表：按Ts的k_iCallback直接调用handler.HandleCallback，不经过虚函数和处理器表
+	/// <para>用sthread_dispatcher::AttachStatic挂到分发器上，Ts中的回调只由这里处理，其余回调仍走登记的处理器</para>
+	/// </summary>
+	template<typename Handler, classic_param... Ts>
+		requires (callback_handler<Handler, Ts> && ...)
+	class static_dispatcher
+	{
+	private:
+		Handler handler;
+
+		static constexpr bool unique_ids() noexcept
+		{
+			std::array<int, sizeof...(Ts)> ids{ Ts::k_iCallback... };
+			std::sort(ids.begin(), ids.end());
+			return std::adjacent_find(ids.begin(), ids.end()) == ids.end();
+		}
+		static_assert(unique_ids(), "duplicate callback types in static_dispatcher");
+
+		template<typename T>
+		bool try_dispatch(int callback_typeid, const void* param)
+		{
+			if (callback_typeid != T::k_iCallback)
+				return false;
+			handler.HandleCallback(reinterpret_cast<const T*>(param));
+			return true;
+		}
+	public:
+		explicit static_dispatcher(Handler&& handler) : handler(std::move(handler)) {}
+		static_dispatcher(const static_dispatcher&) = delete;
+
+		static constexpr bool Contains(int callback_typeid) noexcept
+		{
+			return ((callback_typeid == Ts::k_iCallback) || ...);
+		}
+
+		Handler& Get() noexcept { return handler; }
+
+		/// <summary>
+		/// 不在Ts中的回调返回false
+		/// </summary>
+		bool operator()(int callback_typeid, const void* param)
+		{
+			// 常量比较链，编译器会把它转换成switch
+			return (try_dispatch<Ts>(callback_typeid, param) || ...);
+		}
+
+		static bool Route(void* self, int callback_typeid, const void* param)
+		{
+			return (*static_cast<static_dispatcher*>(self))(callback_typeid, param);
+		}
+	};
+}
@@ -0,0 +1,61 @@
+﻿#pragma once
+#include "types.hpp"
+
+// steam_api中分发器用到的导出函数，只在库内部使用。
+// 这里的声明就是替身库需要实现的全部接口：定义STWKS20_EVENTS_STEAM_STUB后不再按dllimport声明，
+// 可以链接一个静态的替身实现，在没有steam客户端的机器上做基准测试，见bench/steam_stub.cpp
+#if defined(_WIN32) && !defined(STWKS20_EVENTS_STEAM_STUB)
+#define STEAM_API_IMPORT extern "C" __declspec(dllimport)
+#define STEAM_CALLTYPE __cdecl
+#elif defined(_WIN32)
+#define STEAM_API_IMPORT extern "C"
+#define STEAM_CALLTYPE __cdecl
+#else
+#define STEAM_API_IMPORT extern "C"
+#define STEAM_CALLTYPE
+#endif
+
+namespace steam::events::dll
+{
+	using HSteamPipe = int32;
+	using HSteamUser = int32;
+	STEAM_API_IMPORT HSteamPipe STEAM_CALLTYPE SteamAPI_GetHSteamPipe();
+	STEAM_API_IMPORT HSteamUser STEAM_CALLTYPE SteamAPI_GetHSteamUser();
+	STEAM_API_IMPORT HSteamPipe STEAM_CALLTYPE SteamGameServer_GetHSteamPipe();
+	STEAM_API_IMPORT HSteamUser STEAM_CALLTYPE SteamGameServer_GetHSteamUser();
+
+	struct CallbackMsg_t
+	{
+		int32 m_hSteamUser; // Specific user to whom this callback applies.
+		int m_iCallback; // Callback identifier.  (Corresponds to the k_iCallback enum in the callback structure.)
+		uint8* m_pubParam; // Points to the callback structure
+		int m_cubParam; // Size of the data pointed to by m_pubParam
+	};
+
+	struct SteamAPICallCompleted_t
+	{
+		constexpr static int callback_typeid = 700 + 3;
+		SteamAPICall_t m_hAsyncCall;
+		int m_iCallback;
+		uint32 m_cubParam;
+	};
+
+	/// Inform the API that you wish to use manual event dispatch.  This must be called after SteamAPI_Init, but before
+	/// you use any of the other manual dispatch functions below.
+	STEAM_API_IMPORT void STEAM_CALLTYPE SteamAPI_ManualDispatch_Init();
+
+	/// Perform certain periodic actions that need to be performed.
+	STEAM_API_IMPORT void STEAM_CALLTYPE SteamAPI_ManualDispatch_RunFrame(HSteamPipe hSteamPipe);
+
+	/// Fetch the next pending callback on the given pipe, if any.  If a callback is available, true is returned
+	/// and the structure is populated.  In this case, you MUST call SteamAPI_ManualDispatch_FreeLastCallback
+	/// (after dispatching the callback) before calling SteamAPI_ManualDispatch_GetNextCallback again.
+	STEAM_API_IMPORT bool STEAM_CALLTYPE SteamAPI_ManualDispatch_GetNextCallback(HSteamPipe hSteamPipe, CallbackMsg_t * pCallbackMsg);
+
+	/// You must call this after dispatching the callback, if SteamAPI_ManualDispatch_GetNextCallback returns true.
+	STEAM_API_IMPORT void STEAM_CALLTYPE SteamAPI_ManualDispatch_FreeLastCallback(HSteamPipe hSteamPipe);
+
+	/// Return the call result for the specified call on the specified pipe.  You really should
+	/// only call this in a handler for SteamAPICallCompleted_t callback.
+	STEAM_API_IMPORT bool STEAM_CALLTYPE SteamAPI_ManualDispatch_GetAPICallResult(HSteamPipe hSteamPipe, SteamAPICall_t hSteamAPICall, void* pCallback, int cubCallback, int iCallbackExpected, bool& pbFailed);
+}
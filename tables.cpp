@@ -0,0 +1,209 @@
+﻿#include "events.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+	constexpr std::size_t initial_capacity = 64u;
+}
+
+std::size_t steam::events::detail::callresult_table::hash(SteamAPICall_t handle, int callback_typeid) noexcept
+{
+	// SteamAPICall_t基本是连续分配的，需要打散
+	return static_cast<std::size_t>(mix64(handle ^ (uint64(uint32(callback_typeid)) << 32)));
+}
+
+steam::events::detail::callresult_table::callresult_table()
+{
+	rehash(initial_capacity);
+}
+
+steam::events::detail::callresult_table::~callresult_table()
+{
+	delete[] heads;
+}
+
+void steam::events::detail::callresult_table::rehash(std::size_t capacity)
+{
+	HandlerRecord** old = heads;
+	std::size_t oldcap = old ? mask + 1 : 0;
+
+	heads = new HandlerRecord*[capacity]{};
+	mask = capacity - 1;
+
+	// 按原顺序挂到新桶的末尾，同一个键的记录保持登记顺序
+	for (std::size_t i = 0; i < oldcap; ++i)
+	{
+		for (auto* record = old[i]; record;)
+		{
+			auto* next = record->link.next;
+			link(record);
+			record = next;
+		}
+	}
+
+	delete[] old;
+}
+
+void steam::events::detail::callresult_table::reserve(std::size_t n)
+{
+	std::size_t capacity = mask + 1;
+	while (n > capacity)
+		capacity *= 2;
+	if (capacity != mask + 1)
+		rehash(capacity);
+}
+
+void steam::events::detail::callresult_table::link(HandlerRecord* record) noexcept
+{
+	// 负载因子不超过1，链很短
+	HandlerRecord** pnext = &heads[hash(record->handle, record->callback_typeid) & mask];
+	while (*pnext)
+		pnext = &(*pnext)->link.next;
+
+	record->link.next = nullptr;
+	record->link.pprev = pnext;
+	record->link.table = this;
+	*pnext = record;
+}
+
+void steam::events::detail::callresult_table::unlink(HandlerRecord* record) noexcept
+{
+	auto& hook = record->link;
+	*hook.pprev = hook.next;
+	if (hook.next)
+		hook.next->link.pprev = hook.pprev;
+	hook.next = nullptr;
+	hook.pprev = nullptr;
+	hook.table = nullptr;
+	count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+void steam::events::detail::callresult_table::insert(HandlerRecord* record)
+{
+	if (record->link.pprev)
+		throw std::invalid_argument("handler is already registered");
+
+	auto n = count.load(std::memory_order_relaxed);
+	if (n + 1 > mask + 1)
+		rehash((mask + 1) * 2);
+
+	link(record);
+	count.store(n + 1, std::memory_order_relaxed);
+}
+
+steam::events::HandlerRecord* steam::events::detail::callresult_table::take(SteamAPICall_t handle, int callback_typeid) noexcept
+{
+	for (auto* record = heads[hash(handle, callback_typeid) & mask]; record; record = record->link.next)
+	{
+		if (record->handle == handle && record->callback_typeid == callback_typeid)
+		{
+			unlink(record);
+			return record;
+		}
+	}
+	return nullptr;
+}
+
+bool steam::events::detail::callresult_table::erase(HandlerRecord* record) noexcept
+{
+	if (!record->link.pprev || record->link.table != this)
+		return false;
+
+	unlink(record);
+	return true;
+}
+
+steam::events::detail::callback_table::~callback_table()
+{
+	for (auto& block : blocks)
+	{
+		for (int i = 0; block && i < block_size; ++i)
+		{
+			for (auto* record = block[i].head; record;)
+			{
+				auto* next = record->link.next;
+				record->link = {};
+				record = next;
+			}
+		}
+	}
+}
+
+bool steam::events::detail::callresult_table::contains(SteamAPICall_t handle, int callback_typeid, const HandlerRecord* record) const noexcept
+{
+	for (auto* entry = heads[hash(handle, callback_typeid) & mask]; entry; entry = entry->link.next)
+		if (entry == record)
+			return true;
+	return false;
+}
+
+void steam::events::detail::callback_table::insert(HandlerRecord* record)
+{
+	int id = record->callback_typeid;
+	if (id < 0)
+		throw std::invalid_argument("negative callback_typeid");
+	if (record->link.pprev)
+		throw std::invalid_argument("handler is already registered");
+
+	auto block = static_cast<std::size_t>(id / block_size);
+	if (block >= blocks.size())
+		blocks.resize(block + 1);
+	if (!blocks[block])
+		blocks[block] = std::make_unique<bucket[]>(block_size);
+
+	bucket& b = blocks[block][id % block_size];
+	record->link.next = nullptr;
+	record->link.pprev = b.tail;
+	record->link.table = this;
+	*b.tail = record;
+	b.tail = &record->link.next;
+	++count;
+}
+
+bool steam::events::detail::callback_table::erase(HandlerRecord* record) noexcept
+{
+	auto& hook = record->link;
+	bucket* b = locate(record->callback_typeid);
+	if (!hook.pprev || hook.table != this || !b)
+		return false;
+
+	// 正在visit的循环跳过被移除的记录
+	for (auto* c = cursors; c; c = c->outer)
+		if (c->next == record)
+			c->next = hook.next;
+
+	*hook.pprev = hook.next;
+	if (hook.next)
+		hook.next->link.pprev = hook.pprev;
+	else
+		b->tail = hook.pprev;
+	hook.next = nullptr;
+	hook.pprev = nullptr;
+	hook.table = nullptr;
+	--count;
+	return true;
+}
+
+steam::events::detail::callback_snapshot::callback_snapshot(const callback_table& table)
+{
+	records.reserve(table.size());
+	table.for_each([this](int id, const callback_table::bucket& b)
+		{
+			ids.push_back(id);
+			offsets.push_back(static_cast<uint32>(records.size()));
+			for (auto* record = b.head; record; record = record->link.next)
+				records.push_back(record);
+		});
+	offsets.push_back(static_cast<uint32>(records.size()));
+}
+
+std::span<steam::events::HandlerRecord* const> steam::events::detail::callback_snapshot::find(int callback_typeid) const noexcept
+{
+	auto iter = std::lower_bound(ids.begin(), ids.end(), callback_typeid);
+	if (iter == ids.end() || *iter != callback_typeid)
+		return {};
+
+	auto i = iter - ids.begin();
+	return { records.data() + offsets[i], records.data() + offsets[i + 1] };
+}
@@ -0,0 +1,198 @@
+﻿#pragma once
+#include "types.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace steam::events
+{
+	class HandlerRecord;
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// splitmix64的混合步骤，SteamAPICall_t之类连续分配的键先经过它再取桶或取模
+	/// </summary>
+	constexpr uint64 mix64(uint64 x) noexcept
+	{
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	/// <summary>
+	/// 嵌在HandlerRecord中的链表节点，记录登记在callresult_table或callback_table中时使用，登记和注销只改指针
+	/// <para>同一个记录同时只能登记在一个表中、登记一次，insert时检查，已登记时抛出std::invalid_argument</para>
+	/// </summary>
+	struct list_hook
+	{
+		HandlerRecord* next = nullptr;
+		// 指向桶头或前一个节点的next，为空表示不在表中
+		HandlerRecord** pprev = nullptr;
+		// 记录所在的表，erase时核对，不是本表的记录不动
+		const void* table = nullptr;
+	};
+
+	/// <summary>
+	/// 以(SteamAPICall_t, callback_typeid)为键的侵入式链式哈希表，节点就是HandlerRecord::link
+	/// <para>同一个键可以登记多个处理器，按登记顺序取出。只有桶数组扩容时分配内存</para>
+	/// </summary>
+	class callresult_table
+	{
+	private:
+		HandlerRecord** heads = nullptr;
+		std::size_t mask = 0;
+		// 只由持有表的线程修改，原子的只是为了让size()可以在其他线程读取
+		std::atomic<std::size_t> count = 0;
+
+		static std::size_t hash(SteamAPICall_t handle, int callback_typeid) noexcept;
+		void rehash(std::size_t capacity);
+		// 挂到桶的末尾
+		void link(HandlerRecord* record) noexcept;
+		void unlink(HandlerRecord* record) noexcept;
+	public:
+		callresult_table();
+		~callresult_table();
+		callresult_table(const callresult_table&) = delete;
+		callresult_table& operator=(const callresult_table&) = delete;
+
+		/// <summary>
+		/// 记录已登记在某个表中时抛出std::invalid_argument
+		/// </summary>
+		void insert(HandlerRecord* record);
+		/// <summary>
+		/// 预留空间，之后共n个记录以内的insert不再分配内存、不会抛出异常
+		/// </summary>
+		void reserve(std::size_t n);
+
+		/// <summary>
+		/// 取出一个匹配的处理器并从表中移除，没有则返回nullptr
+		/// </summary>
+		HandlerRecord* take(SteamAPICall_t handle, int callback_typeid) noexcept;
+
+		/// <summary>
+		/// 按节点移除，O(1)，返回是否在本表中
+		/// </summary>
+		bool erase(HandlerRecord* record) noexcept;
+		/// <summary>
+		/// 键下是否登记着这个地址的记录，只比较地址，不访问record本身
+		/// </summary>
+		bool contains(SteamAPICall_t handle, int callback_typeid, const HandlerRecord* record) const noexcept;
+
+		/// <summary>
+		/// 记录数，可以在任何线程读取
+		/// </summary>
+		std::size_t size() const noexcept { return count.load(std::memory_order_relaxed); }
+
+		/// <summary>
+		/// 遍历所有记录，f可以释放传给它的记录
+		/// </summary>
+		template<typename F>
+		void for_each(F&& f) const;
+	};
+
+	/// <summary>
+	/// 按callback_typeid分组的回调表，每组是一条侵入式链表，保持登记顺序
+	/// <para>k_iCallback按100一段分布（k_iSteamUserCallbacks = 100，k_iSteamFriendsCallbacks = 300……），</para>
+	/// <para>所以用 id / 100 选段，id % 100 选桶，段按需分配，桶的地址不会变</para>
+	/// </summary>
+	class callback_table
+	{
+	public:
+		struct bucket
+		{
+			HandlerRecord* head = nullptr;
+			HandlerRecord** tail = &head;
+		};
+		static constexpr int block_size = 100;
+	private:
+		// visit中下一个要访问的记录，erase时跳过被移除的记录；visit可以嵌套
+		struct cursor
+		{
+			HandlerRecord* next;
+			cursor* outer;
+		};
+
+		std::vector<std::unique_ptr<bucket[]>> blocks;
+		std::size_t count = 0;
+		cursor* cursors = nullptr;
+
+		bucket* locate(int callback_typeid) const noexcept
+		{
+			auto block = static_cast<std::size_t>(callback_typeid / block_size);
+			if (callback_typeid < 0 || block >= blocks.size() || !blocks[block])
+				return nullptr;
+			return &blocks[block][callback_typeid % block_size];
+		}
+	public:
+		callback_table() = default;
+		/// <summary>
+		/// 摘下仍登记着的记录，它们之后可以登记到其他表
+		/// </summary>
+		~callback_table();
+		callback_table(const callback_table&) = delete;
+		callback_table& operator=(const callback_table&) = delete;
+
+		/// <summary>
+		/// 挂到组的末尾，只有第一次用到某一段id时分配内存。记录已登记在某个表中时抛出std::invalid_argument
+		/// </summary>
+		void insert(HandlerRecord* record);
+
+		/// <summary>
+		/// 按节点移除，O(1)，保持其余处理器的顺序，返回是否在本表中
+		/// </summary>
+		bool erase(HandlerRecord* record) noexcept;
+
+		/// <summary>
+		/// 没有处理器时返回nullptr
+		/// </summary>
+		const bucket* find(int callback_typeid) const noexcept
+		{
+			const bucket* b = locate(callback_typeid);
+			return b && b->head ? b : nullptr;
+		}
+
+		/// <summary>
+		/// 按登记顺序对某个id的处理器调用f(HandlerRecord*)。f中可以注销任何处理器，包括自己；新登记的处理器在本次也会被访问
+		/// </summary>
+		template<typename F>
+		void visit(int callback_typeid, F&& f);
+
+		std::size_t size() const noexcept { return count; }
+
+		/// <summary>
+		/// 按callback_typeid升序遍历非空的组，f(int callback_typeid, const bucket&)
+		/// </summary>
+		template<typename F>
+		void for_each(F&& f) const
+		{
+			for (std::size_t block = 0; block < blocks.size(); ++block)
+			{
+				if (!blocks[block])
+					continue;
+				for (int i = 0; i < block_size; ++i)
+					if (blocks[block][i].head)
+						f(static_cast<int>(block) * block_size + i, blocks[block][i]);
+			}
+		}
+	};
+
+	/// <summary>
+	/// callback_table的只读快照，构造后不再修改，读者无需加锁
+	/// <para>所有处理器连续存放，按id二分查找</para>
+	/// </summary>
+	class callback_snapshot
+	{
+	private:
+		std::vector<int> ids;
+		std::vector<uint32> offsets; // ids.size() + 1个
+		std::vector<HandlerRecord*> records;
+	public:
+		explicit callback_snapshot(const callback_table& table);
+
+		std::span<HandlerRecord* const> find(int callback_typeid) const noexcept;
+	};
+}
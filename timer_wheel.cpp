@@ -0,0 +1,122 @@
+﻿#include "events.hpp"
+#include <algorithm>
+#include <bit>
+
+steam::uint64 steam::events::detail::timer_wheel::tick_of(clock::time_point t) const noexcept
+{
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t - origin).count();
+	return ms > 0 ? static_cast<uint64>(ms) : 0;
+}
+
+void steam::events::detail::timer_wheel::link(HandlerRecord* record) noexcept
+{
+	auto& hook = record->timer;
+	constexpr uint64 span = uint64{ 1 } << (level_count * level_bits);
+
+	// 超出最高层的范围，先挂到本轮最后一个tick，下移时再按真正的deadline计算
+	auto key = hook.deadline;
+	if ((key ^ current) >= span)
+		key = current | (span - 1);
+
+	// 按key与current最高的不同6位组选层，key总比current大，所选的槽在本轮之内；
+	// 相等时挂到当前槽，下移时会在本tick处理
+	int level = 0;
+	auto slot = static_cast<std::size_t>(current) & (slot_count - 1);
+	if (auto diff = key ^ current; diff)
+	{
+		level = (63 - std::countl_zero(diff)) / level_bits;
+		slot = static_cast<std::size_t>(key >> (level * level_bits)) & (slot_count - 1);
+	}
+
+	auto*& head = slots[level][slot];
+	hook.pprev = &head;
+	hook.next = head;
+	if (head)
+		head->timer.pprev = &hook.next;
+	head = record;
+}
+
+steam::events::HandlerRecord* steam::events::detail::timer_wheel::detach(int level, std::size_t slot) noexcept
+{
+	auto* head = slots[level][slot];
+	slots[level][slot] = nullptr;
+	return head;
+}
+
+void steam::events::detail::timer_wheel::schedule(HandlerRecord* record, clock::duration timeout) noexcept
+{
+	cancel(record);
+
+	// 先追上当前时间，避免挂到已经走过的槽；至少等到下一个tick
+	auto now = tick_of(clock::now());
+	if (!count)
+		current = std::max(current, now);
+	auto ticks = std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count();
+	record->timer.deadline = std::max(now, current) + static_cast<uint64>(ticks > 0 ? ticks : 0);
+	if (record->timer.deadline <= current)
+		record->timer.deadline = current + 1;
+
+	link(record);
+	++count;
+}
+
+void steam::events::detail::timer_wheel::cancel(HandlerRecord* record) noexcept
+{
+	auto& hook = record->timer;
+	if (!hook.pprev)
+		return;
+
+	*hook.pprev = hook.next;
+	if (hook.next)
+		hook.next->timer.pprev = hook.pprev;
+	hook = timer_hook{};
+	--count;
+}
+
+steam::events::HandlerRecord* steam::events::detail::timer_wheel::advance(clock::time_point now) noexcept
+{
+	auto target = tick_of(now);
+	HandlerRecord* expired = nullptr;
+
+	while (count && current < target)
+	{
+		++current;
+
+		// 到达高层的边界时，把对应的槽下移
+		for (int level = level_count - 1; level > 0; --level)
+		{
+			auto mask = (uint64{ 1 } << (level * level_bits)) - 1;
+			if (current & mask)
+				continue;
+
+			auto slot = static_cast<std::size_t>(current >> (level * level_bits)) & (slot_count - 1);
+			for (auto* record = detach(level, slot); record;)
+			{
+				auto* next = record->timer.next;
+				link(record);
+				record = next;
+			}
+		}
+
+		for (auto* record = detach(0, current & (slot_count - 1)); record;)
+		{
+			auto* next = record->timer.next;
+			if (record->timer.deadline <= current)
+			{
+				record->timer = timer_hook{};
+				record->timer.next = expired;
+				expired = record;
+				--count;
+			}
+			else
+			{
+				link(record);
+			}
+			record = next;
+		}
+	}
+
+	if (!count)
+		current = std::max(current, target);
+	return expired;
+}
@@ -0,0 +1,61 @@
+﻿#pragma once
+#include "types.hpp"
+#include <array>
+#include <chrono>
+#include <cstddef>
+
+namespace steam::events
+{
+	class HandlerRecord;
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 嵌在HandlerRecord中的定时器节点，由timer_wheel管理
+	/// </summary>
+	struct timer_hook
+	{
+		// 指向槽头或前一个节点的next，为空表示不在时间轮中
+		HandlerRecord** pprev = nullptr;
+		HandlerRecord* next = nullptr;
+		// 到期的tick
+		uint64 deadline = 0;
+	};
+
+	/// <summary>
+	/// 分层时间轮，tick为1毫秒，4层每层64个槽，覆盖约4.6小时，更远的定时器先挂在本轮最后一个槽，下移时重新计算
+	/// <para>按deadline与当前tick最高的不同6位组选层，登记和取消都是O(1)，每个定时器最多下移3次</para>
+	/// <para>本身不加锁，由分发器保护</para>
+	/// </summary>
+	class timer_wheel
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+	private:
+		static constexpr int level_bits = 6;
+		static constexpr std::size_t slot_count = std::size_t{ 1 } << level_bits;
+		static constexpr int level_count = 4;
+
+		std::array<std::array<HandlerRecord*, slot_count>, level_count> slots{};
+		const clock::time_point origin = clock::now();
+		uint64 current = 0;
+		std::size_t count = 0;
+
+		uint64 tick_of(clock::time_point t) const noexcept;
+		void link(HandlerRecord* record) noexcept;
+		// 取下整个槽，返回的链表节点仍保留原来的next
+		HandlerRecord* detach(int level, std::size_t slot) noexcept;
+	public:
+		bool empty() const noexcept { return count == 0; }
+		std::size_t size() const noexcept { return count; }
+
+		void schedule(HandlerRecord* record, clock::duration timeout) noexcept;
+		void cancel(HandlerRecord* record) noexcept;
+
+		/// <summary>
+		/// 推进到now，返回到期的记录，以timer.next串成单链表，已从时间轮中取下
+		/// </summary>
+		HandlerRecord* advance(clock::time_point now) noexcept;
+	};
+}
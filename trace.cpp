@@ -0,0 +1,97 @@
+﻿#include "trace.hpp"
+#include <cstdio>
+#include <ostream>
+#include <utility>
+
+namespace
+{
+	std::atomic<steam::uint64> next_generation = 1;
+
+	const char* const kind_names[] = { "RunFrame", "GetNextCallback", "GetAPICallResult", "Invoke" };
+}
+
+steam::events::detail::trace_sink::trace_sink(std::size_t spans_per_thread)
+	: generation(next_generation++), capacity(spans_per_thread), origin(clock::now())
+{
+}
+
+steam::events::detail::trace_sink::buffer& steam::events::detail::trace_sink::local()
+{
+	thread_local std::vector<std::pair<uint64, buffer*>> cache;
+	for (auto& [gen, b] : cache)
+		if (gen == generation)
+			return *b;
+
+	auto owned = std::make_unique<buffer>();
+	owned->spans = std::make_unique<trace_span[]>(capacity);
+	auto* b = owned.get();
+	{
+		std::lock_guard g{ lock };
+		b->thread_index = static_cast<uint32>(buffers.size());
+		buffers.push_back(std::move(owned));
+	}
+	cache.emplace_back(generation, b);
+	return *b;
+}
+
+void steam::events::detail::trace_sink::record(kind k, uint64 begin, int callback_typeid, SteamAPICall_t handle, uint32 size) noexcept
+{
+	buffer* b;
+	try
+	{
+		b = &local();
+	}
+	catch (...)
+	{
+		// 追踪数据丢失不影响分发
+		return;
+	}
+
+	auto n = b->count.load(std::memory_order_relaxed);
+	if (n >= capacity)
+	{
+		b->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	b->spans[n] = trace_span{ begin, now(), handle, callback_typeid, size, k };
+	b->count.store(n + 1, std::memory_order_release);
+}
+
+void steam::events::detail::trace_sink::write_json(std::ostream& out) const
+{
+	char line[256];
+	bool first = true;
+	auto emit = [&](int length)
+		{
+			if (!first)
+				out << ",\n";
+			first = false;
+			out.write(line, length);
+		};
+
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+
+	std::lock_guard g{ lock };
+	for (auto& b : buffers)
+	{
+		auto tid = b->thread_index + 1;
+		emit(std::snprintf(line, sizeof line,
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"dispatcher thread %u\",\"dropped\":%llu}}",
+			tid, tid, static_cast<unsigned long long>(b->dropped.load(std::memory_order_relaxed))));
+
+		auto count = b->count.load(std::memory_order_acquire);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			const auto& span = b->spans[i];
+			// ts和dur以微秒为单位
+			emit(std::snprintf(line, sizeof line,
+				"{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"callback\":%d,\"call\":%llu,\"size\":%u}}",
+				kind_names[span.kind], tid,
+				static_cast<unsigned long long>(span.begin / 1000), static_cast<unsigned>(span.begin % 1000),
+				static_cast<unsigned long long>((span.end - span.begin) / 1000), static_cast<unsigned>((span.end - span.begin) % 1000),
+				span.callback_typeid, static_cast<unsigned long long>(span.handle), span.size));
+		}
+	}
+
+	out << "\n]}\n";
+}
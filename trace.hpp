@@ -0,0 +1,70 @@
+﻿#pragma once
+#include "types.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 时间线上的一段，时间为相对trace_sink创建时刻的纳秒数
+	/// </summary>
+	struct trace_span
+	{
+		uint64 begin;
+		uint64 end;
+		SteamAPICall_t handle;
+		int callback_typeid;
+		uint32 size;
+		uint8 kind;
+	};
+
+	/// <summary>
+	/// 分发时间线的记录器，每个线程写自己的缓冲区，写满后丢弃新的段
+	/// <para>记录只有写线程自己的relaxed写入和一次release发布，可以在记录的同时导出</para>
+	/// </summary>
+	class trace_sink
+	{
+	public:
+		enum kind : uint8 { run_frame, next_callback, fetch_callresult, invoke };
+		using clock = std::chrono::steady_clock;
+	private:
+		struct buffer
+		{
+			std::unique_ptr<trace_span[]> spans;
+			std::atomic<std::size_t> count = 0;
+			std::atomic<uint64> dropped = 0;
+			uint32 thread_index = 0;
+		};
+
+		const uint64 generation;
+		const std::size_t capacity;
+		const clock::time_point origin;
+
+		mutable std::mutex lock;
+		std::vector<std::unique_ptr<buffer>> buffers;
+
+		// 首次调用时登记当前线程的缓冲区
+		buffer& local();
+	public:
+		explicit trace_sink(std::size_t spans_per_thread);
+		trace_sink(const trace_sink&) = delete;
+
+		uint64 now() const noexcept
+		{
+			return static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - origin).count());
+		}
+
+		// 以当前时刻为结束记录一段
+		void record(kind k, uint64 begin, int callback_typeid, SteamAPICall_t handle, uint32 size) noexcept;
+
+		/// <summary>
+		/// 写出Chrome trace event格式的JSON，chrome://tracing和Perfetto都能打开
+		/// </summary>
+		void write_json(std::ostream& out) const;
+	};
+}
@@ -0,0 +1,62 @@
+﻿#include "pch.h"
+#include "capture.hpp"
+#include <system_error>
+
+namespace
+{
+	HANDLE as_handle(std::intptr_t file) noexcept
+	{
+		return reinterpret_cast<HANDLE>(file);
+	}
+}
+
+void steam::events::detail::capture_log::open_file(const std::filesystem::path& path)
+{
+	HANDLE h = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (h == INVALID_HANDLE_VALUE)
+		throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "CreateFileW");
+	file = reinterpret_cast<std::intptr_t>(h);
+}
+
+void steam::events::detail::capture_log::map(uint64 size)
+{
+	// 映射比文件大时，CreateFileMapping会扩大文件
+	mapping = ::CreateFileMappingW(as_handle(file), nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+	if (!mapping)
+		throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "CreateFileMappingW");
+
+	view = static_cast<uint8*>(::MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(size)));
+	if (!view)
+	{
+		auto error = ::GetLastError();
+		::CloseHandle(mapping);
+		mapping = nullptr;
+		throw std::system_error(static_cast<int>(error), std::system_category(), "MapViewOfFile");
+	}
+	capacity = size;
+}
+
+void steam::events::detail::capture_log::unmap() noexcept
+{
+	if (view)
+		::UnmapViewOfFile(view);
+	if (mapping)
+		::CloseHandle(mapping);
+	view = nullptr;
+	mapping = nullptr;
+	capacity = 0;
+}
+
+void steam::events::detail::capture_log::close_file() noexcept
+{
+	if (as_handle(file) == INVALID_HANDLE_VALUE)
+		return;
+
+	// 截掉映射时预留的空间
+	LARGE_INTEGER end;
+	end.QuadPart = static_cast<LONGLONG>(used);
+	if (::SetFilePointerEx(as_handle(file), end, nullptr, FILE_BEGIN))
+		::SetEndOfFile(as_handle(file));
+	::CloseHandle(as_handle(file));
+	file = -1;
+}
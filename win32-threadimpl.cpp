@@ -0,0 +1,68 @@
+﻿#include "pch.h"
+#include "os_thread.hpp"
+#include <process.h>
+#include <cerrno>
+#include <system_error>
+
+namespace
+{
+	unsigned __stdcall thread_entry(void* self)
+	{
+		steam::events::detail::os_thread::run(self);
+		return 0;
+	}
+
+	int native_priority(steam::events::thread_priority priority) noexcept
+	{
+		switch (priority)
+		{
+		case steam::events::thread_priority::lowest: return THREAD_PRIORITY_LOWEST;
+		case steam::events::thread_priority::below_normal: return THREAD_PRIORITY_BELOW_NORMAL;
+		case steam::events::thread_priority::above_normal: return THREAD_PRIORITY_ABOVE_NORMAL;
+		case steam::events::thread_priority::highest: return THREAD_PRIORITY_HIGHEST;
+		case steam::events::thread_priority::time_critical: return THREAD_PRIORITY_TIME_CRITICAL;
+		default: return THREAD_PRIORITY_NORMAL;
+		}
+	}
+}
+
+void steam::events::detail::os_thread::create()
+{
+	// _beginthreadex而非CreateThread，线程中可以安全使用CRT
+	auto h = ::_beginthreadex(nullptr, static_cast<unsigned>(options.stack_size), thread_entry, this, options.stack_size ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, nullptr);
+	if (!h)
+		throw std::system_error(errno, std::generic_category(), "_beginthreadex");
+	handle = static_cast<std::uintptr_t>(h);
+}
+
+void steam::events::detail::os_thread::wait() noexcept
+{
+	auto h = reinterpret_cast<HANDLE>(handle);
+	::WaitForSingleObject(h, INFINITE);
+	::CloseHandle(h);
+	handle = 0;
+}
+
+void steam::events::detail::os_thread::detach() noexcept
+{
+	::CloseHandle(reinterpret_cast<HANDLE>(handle));
+	handle = 0;
+}
+
+void steam::events::detail::os_thread::configure() const
+{
+	HANDLE self = ::GetCurrentThread();
+	if (options.affinity && !::SetThreadAffinityMask(self, static_cast<DWORD_PTR>(options.affinity)))
+		throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "SetThreadAffinityMask");
+
+	if (options.priority != thread_priority::normal && !::SetThreadPriority(self, native_priority(options.priority)))
+		throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "SetThreadPriority");
+
+	if (!options.name.empty())
+	{
+		int length = ::MultiByteToWideChar(CP_UTF8, 0, options.name.data(), static_cast<int>(options.name.size()), nullptr, 0);
+		std::wstring name(static_cast<std::size_t>(length), L'\0');
+		::MultiByteToWideChar(CP_UTF8, 0, options.name.data(), static_cast<int>(options.name.size()), name.data(), length);
+		::SetThreadDescription(self, name.c_str());
+	}
+}
@@ -0,0 +1,165 @@
+﻿#include "worker_pool.hpp"
+#include "tables.hpp"
+#include <algorithm>
+#include <limits>
+
+steam::events::detail::worker_pool::worker_pool(unsigned threads, const std::atomic<uint64>& versions, runner run) : versions(versions), run(std::move(run))
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < threads; ++i)
+		workers.emplace_back(std::make_unique<worker>());
+
+	for (std::size_t i = 0; i < workers.size(); ++i)
+		workers[i]->thread = std::thread{ &worker_pool::worker_main, this, i };
+}
+
+steam::events::detail::worker_pool::~worker_pool()
+{
+	{
+		std::lock_guard g{ sleep_lock };
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto& w : workers)
+		if (w->thread.joinable())
+			w->thread.join();
+}
+
+void steam::events::detail::worker_pool::push(std::size_t index, task_ptr task, bool pin)
+{
+	auto& w = *workers[index];
+	{
+		std::lock_guard g{ w.lock };
+		if (pin)
+			w.pinned.push_back(std::move(task));
+		else
+			w.shared.push_back(std::move(task));
+	}
+
+	{
+		std::lock_guard g{ sleep_lock };
+		if (pin)
+			++w.pinned_count;
+		else
+			++shared_count;
+	}
+
+	// 固定任务只能由指定线程执行，只好全部唤醒
+	if (pin)
+		wake.notify_all();
+	else
+		wake.notify_one();
+}
+
+void steam::events::detail::worker_pool::submit(task_ptr task)
+{
+	auto index = next++ % workers.size();
+	push(index, std::move(task), false);
+}
+
+void steam::events::detail::worker_pool::submit(task_ptr task, uint64 key)
+{
+	// 与callresult_table相同的混合，避免连续的句柄集中到同一个线程
+	push(static_cast<std::size_t>(mix64(key) % workers.size()), std::move(task), true);
+}
+
+steam::events::detail::worker_pool::task_ptr steam::events::detail::worker_pool::pop(std::size_t index) noexcept
+{
+	auto& self = *workers[index];
+	{
+		std::lock_guard g{ self.lock };
+		if (!self.pinned.empty())
+		{
+			auto task = std::move(self.pinned.front());
+			self.pinned.pop_front();
+			--self.pinned_count;
+			return task;
+		}
+		if (!self.shared.empty())
+		{
+			auto task = std::move(self.shared.front());
+			self.shared.pop_front();
+			--shared_count;
+			return task;
+		}
+	}
+
+	// 从其他线程的队尾窃取
+	for (std::size_t i = 1; i < workers.size(); ++i)
+	{
+		auto& victim = *workers[(index + i) % workers.size()];
+		std::lock_guard g{ victim.lock };
+		if (!victim.shared.empty())
+		{
+			auto task = std::move(victim.shared.back());
+			victim.shared.pop_back();
+			--shared_count;
+			return task;
+		}
+	}
+	return nullptr;
+}
+
+namespace
+{
+	// 工作线程所属的池和正在执行的任务，供处理器中的注销排除自己
+	thread_local const steam::events::detail::worker_pool* current_pool = nullptr;
+	thread_local const steam::events::detail::pool_task* current_task = nullptr;
+}
+
+void steam::events::detail::worker_pool::worker_main(std::size_t index) noexcept
+{
+	current_pool = this;
+	auto& self = *workers[index];
+	for (;;)
+	{
+		if (auto task = pop(index))
+		{
+			if (task->callback)
+			{
+				// 持锁取版本，与oldest_version互斥：先于它登记的版本会被看到，晚于它的不会比它读到的版本旧
+				std::lock_guard g{ inflight_lock };
+				task->version = versions.load();
+				++inflight[task->version];
+			}
+			current_task = task.get();
+			run(*task);
+			current_task = nullptr;
+			if (task->callback)
+			{
+				std::lock_guard g{ inflight_lock };
+				auto iter = inflight.find(task->version);
+				if (!--iter->second)
+					inflight.erase(iter);
+			}
+			continue;
+		}
+
+		std::unique_lock g{ sleep_lock };
+		wake.wait(g, [&] { return stopping || self.pinned_count || shared_count; });
+		if (stopping && !self.pinned_count && !shared_count)
+			return;
+	}
+}
+
+steam::uint64 steam::events::detail::worker_pool::oldest_version(bool exclude_current) const noexcept
+{
+	const pool_task* own = exclude_current && current_pool == this && current_task && current_task->callback ? current_task : nullptr;
+	std::lock_guard g{ inflight_lock };
+	for (auto& [version, count] : inflight)
+	{
+		// 与当前任务同版本的只剩它自己时跳过
+		if (own && version == own->version && count == 1)
+			continue;
+		return version;
+	}
+	return std::numeric_limits<uint64>::max();
+}
+
+const steam::events::detail::worker_pool* steam::events::detail::worker_pool::current() noexcept
+{
+	return current_pool;
+}
@@ -0,0 +1,123 @@
+﻿#pragma once
+#include "types.hpp"
+#include "param_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace steam::events
+{
+	class HandlerRecord;
+
+	/// <summary>
+	/// 工作线程池模式下的顺序保证
+	/// </summary>
+	enum class dispatch_order
+	{
+		// 不保证顺序，任务可被任意工作线程窃取
+		none,
+		// 相同callback_typeid的消息按到达顺序依次执行
+		per_callback,
+		// 相同SteamAPICall_t的调用结果依次执行，回调不保证顺序
+		per_call,
+	};
+
+	struct pool_options
+	{
+		// 0表示std::thread::hardware_concurrency()
+		unsigned workers = 0;
+		dispatch_order order = dispatch_order::per_callback;
+	};
+}
+
+namespace steam::events::detail
+{
+	/// <summary>
+	/// 轮询线程复制出来的一条消息
+	/// </summary>
+	struct pool_task
+	{
+		// 调用结果的处理器；回调任务为空，开始执行时才从快照取处理器
+		std::vector<HandlerRecord*> handlers;
+		// 调用结果取到了租借的缓冲区时用lease，否则复制到payload
+		param_lease lease;
+		std::vector<uint8> payload;
+		// 回调任务的id和开始执行时的快照版本，排队中的任务不引用快照
+		bool callback = false;
+		int callback_typeid = 0;
+		uint64 version = 0;
+		bool iofail = false;
+		// 取出消息的时间，未启用统计时为默认值
+		std::chrono::steady_clock::time_point fetched;
+	};
+
+	/// <summary>
+	/// 工作窃取线程池。带键的任务固定交给 hash(key) % workers 号线程，按提交顺序执行且不可被窃取；
+	/// 不带键的任务轮流分配，空闲线程可以窃取
+	/// </summary>
+	class worker_pool
+	{
+	public:
+		using task_ptr = std::unique_ptr<pool_task>;
+		using runner = std::function<void(pool_task&)>;
+	private:
+		struct worker
+		{
+			std::mutex lock;
+			std::deque<task_ptr> pinned;
+			std::deque<task_ptr> shared;
+			std::atomic<std::size_t> pinned_count = 0;
+			std::thread thread;
+		};
+
+		std::vector<std::unique_ptr<worker>> workers;
+		std::atomic<std::size_t> shared_count = 0;
+		std::size_t next = 0; // 只由提交线程访问
+
+		std::mutex sleep_lock;
+		std::condition_variable wake;
+		bool stopping = false; // sleep_lock保护
+
+		// 正在执行的回调任务的快照版本及数量
+		mutable std::mutex inflight_lock;
+		std::map<uint64, std::size_t> inflight;
+		const std::atomic<uint64>& versions;
+
+		runner run;
+
+		void worker_main(std::size_t index) noexcept;
+		task_ptr pop(std::size_t index) noexcept;
+		void push(std::size_t index, task_ptr task, bool pin);
+	public:
+		/// <summary>
+		/// 回调任务开始执行时从versions取快照版本，执行完之前oldest_version不会超过它
+		/// </summary>
+		worker_pool(unsigned threads, const std::atomic<uint64>& versions, runner run);
+		/// <summary>
+		/// 执行完已提交的任务后退出所有工作线程
+		/// </summary>
+		~worker_pool();
+		worker_pool(const worker_pool&) = delete;
+
+		void submit(task_ptr task);
+		void submit(task_ptr task, uint64 key);
+
+		/// <summary>
+		/// 正在执行的回调任务中最旧的快照版本，没有时返回UINT64_MAX
+		/// <para>exclude_current为true且在本池的工作线程中调用时，不计当前正在执行的任务</para>
+		/// </summary>
+		uint64 oldest_version(bool exclude_current = false) const noexcept;
+		/// <summary>
+		/// 当前线程所属的池，不是工作线程时返回nullptr
+		/// </summary>
+		static const worker_pool* current() noexcept;
+	};
+}